@@ -0,0 +1,661 @@
+#ifndef MINIMESH_EMULATION_HPP
+#define MINIMESH_EMULATION_HPP
+// Linux only. Runs every node as its own process: frames travel over UDP
+// multicast on the loopback interface, and each process decides from a
+// topology file which of them its radio would have heard. A scenario file
+// injects faults while the mesh runs, and the collector process reports how
+// long the mesh took to recover from each. Link quality can also be replayed
+// from traces recorded in the field.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "minimesh2.hpp"
+
+namespace minimesh::emulation
+{
+    /* -------------------------------------------------------------------------- */
+    /*                               User Interface                               */
+    /* -------------------------------------------------------------------------- */
+    struct Options
+    {
+        const char *group = "239.255.42.99";
+        uint16_t port = 42099;
+        double loss = 0.0;              // Chance a frame is lost on a link the topology gives no loss for
+        uint32_t latency_ms = 0;        // Added to every frame
+        uint32_t jitter_ms = 0;         // Random extra latency, up to this much
+        uint32_t busy_ms = 2;           // Channel counts as busy this long after hearing a neighbour
+        uint32_t radio_off_us = 20000;  // Sleeps at least this long switch the radio off, frames sent meanwhile are lost
+        const char *topology = nullptr; // Who hears whom, everyone hears everyone without one
+        const char *scenario = nullptr; // Faults to inject, none without one
+        const char *trace = nullptr;    // Recorded link quality, overrides the topology for the links it covers
+        bool is_trace_looped = true;    // Start the trace over when the run outlasts it
+        double sensitivity_dbm = -100;  // Traced frames weaker than this are not heard at all
+        double cca_threshold_dbm = -85; // Traced frames weaker than this do not make the channel busy
+    };
+    // Frames are prefixed with the transmitter's Id on the wire
+    static constexpr uint32_t max_frame_size = 2048;
+
+    // Opens the socket and reads the topology. Call once per process, before
+    // the Handle runs. The topology file has one link per line:
+    //   a b [loss]    a and b hear each other
+    //   a > b [loss]  only b hears a
+    // Blank lines and lines starting with # are ignored.
+    //
+    // The scenario file has one fault per line, at milliseconds since the run
+    // started. All node processes share the start time through the
+    // MINIMESH_EMULATION_START_MS environment variable, which init() sets if
+    // the launcher did not.
+    //   1500 crash 4          node 4 stops dead
+    //   4000 reboot 4         and comes back with fresh RAM: its process is re-executed
+    //                         with the same command line, which must select the node
+    //   2000 degrade 2 5 0.6  frames between 2 and 5 are lost with this chance
+    //   3000 restore 2 5      back to the topology's loss
+    //   2000 partition 2 4 5  these nodes and the rest no longer hear each other
+    //   3000 heal             partition lifted
+    //   1000 skew 7 200       node 7's clock runs 200 ppm fast
+    //
+    // The trace file is a time series per link, one sample per line, each
+    // holding until the next sample of the same link:
+    //   time_ms transmitter receiver prr [rssi_dbm]
+    // The packet reception ratio decides frame loss and the RSSI, when
+    // recorded, decides whether the frame is heard and whether it holds the
+    // channel busy. Scenario faults take precedence over the trace.
+    auto init(Id id, const Options &options = {}) -> bool;
+    // Adapters for Handle's template parameters
+    auto receive(uint32_t timeout_ms) -> Bytes;
+    auto transmit(ConstBytes bytes) -> void;
+    auto sleep(uint32_t duration_us) -> void;
+    auto is_channel_busy() -> bool;
+    auto clock() -> uint32_t;
+    // Collector side of a fault injection run: call record_reading() from the
+    // collector callback and end_round() after every run(). print_report()
+    // tells, for every fault, how long until a round delivered as many
+    // readings as before it (less the nodes that are down), and how many
+    // readings were lost until then.
+    auto record_reading(Id device_id) -> void;
+    auto end_round() -> void;
+    auto print_report(std::FILE *file) -> void;
+
+    /* -------------------------------------------------------------------------- */
+    /*                               Implementation                               */
+    /* -------------------------------------------------------------------------- */
+    namespace detail
+    {
+        struct Link
+        {
+            Id transmitter;
+            double loss;
+        };
+        struct Frame
+        {
+            uint32_t due_ms; // When the frame reaches the receiver's radio
+            uint32_t length;
+            uint8_t buffer[max_frame_size];
+        };
+        enum EventKind
+        {
+            Crash,
+            Reboot,
+            Degrade,
+            Restore,
+            Partition,
+            Heal,
+            Skew,
+        };
+        constexpr const char *event_names[] = {"crash", "reboot", "degrade", "restore", "partition", "heal", "skew"};
+        struct Event
+        {
+            uint32_t at_ms; // Since the run started
+            EventKind kind;
+            Id a, b;
+            double value;          // Loss for degrade, ppm for skew
+            std::vector<Id> group; // Nodes split off by a partition
+        };
+        struct TraceSample
+        {
+            uint32_t at_ms;
+            double prr;
+            double rssi_dbm;
+        };
+        struct TraceLink
+        {
+            Id transmitter;
+            std::vector<TraceSample> samples; // By time
+        };
+        struct Round
+        {
+            uint32_t ended_ms;
+            uint32_t readings;
+        };
+        struct Node
+        {
+            int socket = -1;
+            Id id;
+            Options options;
+            sockaddr_in group_address;
+            bool has_topology;
+            std::vector<Link> links; // Transmitters this node hears
+            std::deque<Frame> pending; // Heard, waiting out their latency, by due time
+            uint32_t last_heard_ms;
+            bool has_heard;
+            std::mt19937 random;
+            Frame current; // Last frame handed out by receive()
+            uint64_t start_ms; // Wall clock time the run started, shared by all processes
+            std::vector<Event> events;
+            size_t next_event;
+            std::vector<Link> degraded; // Loss overrides for transmitters we hear
+            std::vector<Id> partition;
+            double skew_ppm;
+            uint32_t skew_base_ms;  // clock() when the skew last changed
+            uint64_t skew_since_ms; // steady time when the skew last changed
+            std::vector<Id> round_sources; // Devices heard from this round, collector only
+            std::vector<Round> rounds;
+            std::vector<TraceLink> trace; // Links towards us only
+            uint32_t trace_length_ms;
+        };
+        inline Node node;
+
+        inline auto is_before(uint32_t a, uint32_t b) -> bool
+        {
+            return static_cast<int32_t>(a - b) < 0;
+        }
+        inline auto is_in(const std::vector<Id> &ids, Id id) -> bool
+        {
+            for (const auto other : ids)
+                if (other == id)
+                    return true;
+            return false;
+        }
+        // Real time for the emulation itself, clock() is what the node believes
+        inline auto now_ms() -> uint64_t
+        {
+            using namespace std::chrono;
+            return static_cast<uint64_t>(duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count());
+        }
+        inline auto wall_ms() -> uint64_t
+        {
+            timeval time;
+            ::gettimeofday(&time, nullptr);
+            return static_cast<uint64_t>(time.tv_sec) * 1000 + time.tv_usec / 1000;
+        }
+        inline auto scenario_ms() -> uint32_t
+        {
+            return static_cast<uint32_t>(wall_ms() - node.start_ms);
+        }
+        // A skewed clock also stretches the node's timeouts and sleeps
+        inline auto real_us(uint64_t node_us) -> uint64_t
+        {
+            return static_cast<uint64_t>(node_us * 1e6 / (1e6 + node.skew_ppm));
+        }
+        inline auto add_link(Id transmitter, Id receiver, double loss) -> void
+        {
+            if (receiver == node.id)
+                node.links.push_back({transmitter, loss});
+        }
+        inline auto load_topology(const char *path) -> bool
+        {
+            const auto file = std::fopen(path, "r");
+            if (file == nullptr)
+                return false;
+            char line[128];
+            while (std::fgets(line, sizeof(line), file) != nullptr)
+            {
+                unsigned a, b;
+                double loss = node.options.loss;
+                if (std::sscanf(line, " %u > %u %lf", &a, &b, &loss) >= 2)
+                    add_link(a, b, loss);
+                else if (std::sscanf(line, " %u %u %lf", &a, &b, &loss) >= 2)
+                {
+                    add_link(a, b, loss);
+                    add_link(b, a, loss);
+                }
+            }
+            std::fclose(file);
+            node.has_topology = true;
+            return true;
+        }
+        inline auto load_trace(const char *path) -> bool
+        {
+            const auto file = std::fopen(path, "r");
+            if (file == nullptr)
+                return false;
+            char line[128];
+            while (std::fgets(line, sizeof(line), file) != nullptr)
+            {
+                unsigned at, transmitter, receiver;
+                double prr, rssi_dbm = 0; // Without RSSI the frame is always strong enough
+                if (std::sscanf(line, " %u %u %u %lf %lf", &at, &transmitter, &receiver, &prr, &rssi_dbm) < 4)
+                    continue;
+                node.trace_length_ms = at + 1 > node.trace_length_ms ? at + 1 : node.trace_length_ms;
+                if (receiver != node.id)
+                    continue;
+                auto link = node.trace.begin();
+                while (link != node.trace.end() && link->transmitter != transmitter)
+                    link++;
+                if (link == node.trace.end())
+                    link = node.trace.insert(link, {transmitter, {}});
+                link->samples.push_back({at, prr, rssi_dbm});
+            }
+            std::fclose(file);
+            for (auto &link : node.trace)
+                std::stable_sort(link.samples.begin(), link.samples.end(),
+                                 [](const TraceSample &a, const TraceSample &b) { return a.at_ms < b.at_ms; });
+            return true;
+        }
+        // Sample in effect for the link from transmitter, nullptr when the trace does not cover it
+        inline auto trace_sample(Id transmitter) -> const TraceSample *
+        {
+            for (const auto &link : node.trace)
+            {
+                if (link.transmitter != transmitter)
+                    continue;
+                auto at = scenario_ms();
+                if (node.options.is_trace_looped)
+                    at %= node.trace_length_ms;
+                const auto later = std::upper_bound(link.samples.begin(), link.samples.end(), at,
+                                                    [](uint32_t at, const TraceSample &sample) { return at < sample.at_ms; });
+                return later == link.samples.begin() ? &link.samples.front() : &*std::prev(later);
+            }
+            return nullptr;
+        }
+        // Chance that a frame from transmitter is lost, or a negative number if we cannot hear it at all
+        inline auto loss_from(Id transmitter) -> double
+        {
+            if (transmitter == node.id)
+                return -1;
+            if (!node.partition.empty() && is_in(node.partition, transmitter) != is_in(node.partition, node.id))
+                return -1;
+            for (const auto &link : node.degraded)
+                if (link.transmitter == transmitter)
+                    return link.loss;
+            if (const auto sample = trace_sample(transmitter))
+                return sample->rssi_dbm < node.options.sensitivity_dbm ? -1 : 1 - sample->prr;
+            if (!node.has_topology)
+                return node.options.loss;
+            for (const auto &link : node.links)
+                if (link.transmitter == transmitter)
+                    return link.loss;
+            return -1;
+        }
+        inline auto chance() -> double
+        {
+            return std::uniform_real_distribution<double>(0, 1)(node.random);
+        }
+        // Keep pending sorted by due time, so jitter can reorder frames like a real channel cannot
+        // but latency alone never does
+        inline auto schedule(const uint8_t *buf, uint32_t len, uint32_t now) -> void
+        {
+            auto due = now + node.options.latency_ms;
+            if (node.options.jitter_ms > 0)
+                due += std::uniform_int_distribution<uint32_t>(0, node.options.jitter_ms)(node.random);
+            auto position = node.pending.end();
+            while (position != node.pending.begin() && is_before(due, std::prev(position)->due_ms))
+                position--;
+            auto frame = node.pending.emplace(position);
+            frame->due_ms = due;
+            frame->length = len;
+            for (uint32_t i = 0; i < len; i++)
+                frame->buffer[i] = buf[i];
+        }
+        // Wait up to timeout_ms for one datagram and schedule it if our radio hears it
+        inline auto poll_socket(uint32_t timeout_ms) -> bool
+        {
+            pollfd descriptor = {node.socket, POLLIN, 0};
+            if (::poll(&descriptor, 1, static_cast<int>(timeout_ms)) <= 0)
+                return false;
+            uint8_t datagram[sizeof(Id) + max_frame_size];
+            const auto received = ::recv(node.socket, datagram, sizeof(datagram), 0);
+            if (received < static_cast<ssize_t>(sizeof(Id)))
+                return true;
+            const auto transmitter = *reinterpret_cast<const Id *>(datagram);
+            const auto loss = loss_from(transmitter);
+            if (loss < 0)
+                return true;
+            const auto now = static_cast<uint32_t>(now_ms());
+            const auto sample = trace_sample(transmitter);
+            if (sample == nullptr || sample->rssi_dbm >= node.options.cca_threshold_dbm)
+            {
+                node.last_heard_ms = now;
+                node.has_heard = true;
+            }
+            if (loss > 0 && chance() < loss)
+                return true;
+            schedule(datagram + sizeof(Id), static_cast<uint32_t>(received) - sizeof(Id), now);
+            return true;
+        }
+        inline auto drain_socket() -> void
+        {
+            while (poll_socket(0))
+                ;
+        }
+
+        inline auto load_scenario(const char *path) -> bool
+        {
+            const auto file = std::fopen(path, "r");
+            if (file == nullptr)
+                return false;
+            char line[256];
+            while (std::fgets(line, sizeof(line), file) != nullptr)
+            {
+                unsigned at;
+                char name[16];
+                int consumed = 0;
+                if (std::sscanf(line, " %u %15s %n", &at, name, &consumed) < 2)
+                    continue;
+                Event event = {at, Crash, 0, 0, 0, {}};
+                auto kind = 0u;
+                while (kind < sizeof(event_names) / sizeof(event_names[0]) && std::strcmp(name, event_names[kind]) != 0)
+                    kind++;
+                if (kind == sizeof(event_names) / sizeof(event_names[0]))
+                    continue;
+                event.kind = static_cast<EventKind>(kind);
+                unsigned a = 0, b = 0;
+                const auto args = line + consumed;
+                if (event.kind == Partition)
+                {
+                    auto cursor = args;
+                    char *end;
+                    for (auto id = std::strtoul(cursor, &end, 10); end != cursor; id = std::strtoul(cursor, &end, 10))
+                    {
+                        event.group.push_back(static_cast<Id>(id));
+                        cursor = end;
+                    }
+                }
+                else if (event.kind == Degrade || event.kind == Restore)
+                    std::sscanf(args, "%u %u %lf", &a, &b, &event.value);
+                else
+                    std::sscanf(args, "%u %lf", &a, &event.value);
+                event.a = a;
+                event.b = b;
+                auto position = node.events.end();
+                while (position != node.events.begin() && std::prev(position)->at_ms > at)
+                    position--;
+                node.events.insert(position, event);
+            }
+            std::fclose(file);
+            return true;
+        }
+        // A process is as fresh as rebooted RAM, so reboots re-execute our own binary
+        [[noreturn]] inline auto crash() -> void
+        {
+            ::close(node.socket);
+            const Event *reboot = nullptr;
+            for (auto i = node.next_event; i < node.events.size() && reboot == nullptr; i++)
+                if (node.events[i].kind == Reboot && node.events[i].a == node.id)
+                    reboot = &node.events[i];
+            if (reboot == nullptr)
+                std::_Exit(0);
+            while (scenario_ms() < reboot->at_ms)
+                std::this_thread::sleep_for(std::chrono::milliseconds(reboot->at_ms - scenario_ms()));
+            static char arguments[4096];
+            const auto file = std::fopen("/proc/self/cmdline", "r");
+            const auto length = file != nullptr ? std::fread(arguments, 1, sizeof(arguments) - 1, file) : 0;
+            if (file != nullptr)
+                std::fclose(file);
+            std::vector<char *> argv;
+            for (size_t i = 0; i < length; i += std::strlen(arguments + i) + 1)
+                argv.push_back(arguments + i);
+            argv.push_back(nullptr);
+            ::execv("/proc/self/exe", argv.data());
+            std::_Exit(1);
+        }
+        inline auto set_skew(double ppm) -> void
+        {
+            node.skew_base_ms = clock();
+            node.skew_since_ms = now_ms();
+            node.skew_ppm = ppm;
+        }
+        inline auto apply(const Event &event, bool is_replay) -> void
+        {
+            const auto self = node.id;
+            const auto other = event.a == self ? event.b : event.a;
+            const auto is_our_link = event.a == self || event.b == self;
+            switch (event.kind)
+            {
+            case Crash:
+                if (event.a == self && !is_replay)
+                    crash();
+                break;
+            case Reboot:
+                break;
+            case Degrade:
+            case Restore:
+                if (!is_our_link)
+                    break;
+                for (auto link = node.degraded.begin(); link != node.degraded.end(); link++)
+                    if (link->transmitter == other)
+                    {
+                        node.degraded.erase(link);
+                        break;
+                    }
+                if (event.kind == Degrade)
+                    node.degraded.push_back({other, event.value});
+                break;
+            case Partition:
+                node.partition = event.group;
+                break;
+            case Heal:
+                node.partition.clear();
+                break;
+            case Skew:
+                if (event.a == self)
+                    set_skew(event.value);
+                break;
+            }
+        }
+        // Faults take effect the next time the node touches its radio or clock
+        inline auto apply_due_events(bool is_replay = false) -> void
+        {
+            const auto now = scenario_ms();
+            while (node.next_event < node.events.size() && node.events[node.next_event].at_ms <= now)
+                apply(node.events[node.next_event++], is_replay);
+        }
+        // Nodes crashed and not rebooted yet at a point of the run
+        inline auto nodes_down_at(uint32_t at_ms) -> uint32_t
+        {
+            std::vector<Id> down;
+            for (const auto &event : node.events)
+            {
+                if (event.at_ms > at_ms)
+                    break;
+                if (event.kind == Crash && !is_in(down, event.a))
+                    down.push_back(event.a);
+                if (event.kind == Reboot)
+                    for (auto id = down.begin(); id != down.end(); id++)
+                        if (*id == event.a)
+                        {
+                            down.erase(id);
+                            break;
+                        }
+            }
+            return static_cast<uint32_t>(down.size());
+        }
+    }
+
+    inline auto clock() -> uint32_t
+    {
+        using namespace detail;
+        const auto elapsed = static_cast<double>(now_ms() - node.skew_since_ms);
+        return node.skew_base_ms + static_cast<uint32_t>(elapsed * (1e6 + node.skew_ppm) / 1e6);
+    }
+
+    inline auto init(Id id, const Options &options) -> bool
+    {
+        using namespace detail;
+        node.id = id;
+        node.options = options;
+        node.random.seed(id);
+        if (options.topology != nullptr && !load_topology(options.topology))
+            return false;
+        const auto start = std::getenv("MINIMESH_EMULATION_START_MS");
+        node.start_ms = start != nullptr ? std::strtoull(start, nullptr, 10) : wall_ms();
+        if (start == nullptr)
+            ::setenv("MINIMESH_EMULATION_START_MS", std::to_string(node.start_ms).c_str(), 1);
+        node.skew_base_ms = static_cast<uint32_t>(now_ms());
+        node.skew_since_ms = now_ms();
+        if (options.scenario != nullptr && !load_scenario(options.scenario))
+            return false;
+        if (options.trace != nullptr && !load_trace(options.trace))
+            return false;
+        apply_due_events(true); // After a reboot, catch up with the faults still in effect
+        node.socket = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (node.socket < 0)
+            return false;
+        // Every node process binds the same port
+        const int yes = 1;
+        ::setsockopt(node.socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        sockaddr_in local = {};
+        local.sin_family = AF_INET;
+        local.sin_port = htons(options.port);
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (::bind(node.socket, reinterpret_cast<sockaddr *>(&local), sizeof(local)) < 0)
+            return false;
+        // Stay on this machine: loopback interface, looped back to ourselves, never routed
+        in_addr loopback = {htonl(INADDR_LOOPBACK)};
+        ip_mreq membership = {};
+        membership.imr_interface = loopback;
+        if (::inet_pton(AF_INET, options.group, &membership.imr_multiaddr) != 1 ||
+            ::setsockopt(node.socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0)
+            return false;
+        const uint8_t loop = 1, ttl = 0;
+        ::setsockopt(node.socket, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback));
+        ::setsockopt(node.socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        ::setsockopt(node.socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        node.group_address = {};
+        node.group_address.sin_family = AF_INET;
+        node.group_address.sin_port = htons(options.port);
+        node.group_address.sin_addr = membership.imr_multiaddr;
+        return true;
+    }
+
+    // A timeout of 0 waits for a frame however long it takes, like a radio
+    inline auto receive(uint32_t timeout_ms) -> Bytes
+    {
+        using namespace detail;
+        // Waiting forever still wakes up now and then, so scenario faults happen on time
+        constexpr uint32_t blocking_poll_ms = 10;
+        apply_due_events();
+        const auto is_blocking = timeout_ms == 0;
+        const auto deadline = static_cast<uint32_t>(now_ms() + real_us(timeout_ms * 1000ull) / 1000);
+        while (true)
+        {
+            apply_due_events();
+            const auto now = static_cast<uint32_t>(now_ms());
+            if (!node.pending.empty() && !is_before(now, node.pending.front().due_ms))
+            {
+                node.current = node.pending.front();
+                node.pending.pop_front();
+                return {node.current.buffer, node.current.length};
+            }
+            if (!is_blocking && !is_before(now, deadline))
+                return {node.current.buffer, 0};
+            auto wait = is_blocking ? blocking_poll_ms : deadline - now;
+            if (!node.pending.empty() && is_before(node.pending.front().due_ms, now + wait))
+                wait = node.pending.front().due_ms - now;
+            poll_socket(wait);
+        }
+    }
+
+    inline auto transmit(ConstBytes bytes) -> void
+    {
+        using namespace detail;
+        apply_due_events();
+        if (bytes.len > max_frame_size)
+            return;
+        uint8_t datagram[sizeof(Id) + max_frame_size];
+        *reinterpret_cast<Id *>(datagram) = node.id;
+        for (uint32_t i = 0; i < bytes.len; i++)
+            datagram[sizeof(Id) + i] = bytes.buf[i];
+        ::sendto(node.socket, datagram, sizeof(Id) + bytes.len, 0,
+                 reinterpret_cast<const sockaddr *>(&node.group_address), sizeof(node.group_address));
+    }
+
+    inline auto sleep(uint32_t duration_us) -> void
+    {
+        using namespace detail;
+        std::this_thread::sleep_for(std::chrono::microseconds(real_us(duration_us)));
+        apply_due_events();
+        if (duration_us < node.options.radio_off_us)
+            return;
+        // The radio was off: whatever was sent meanwhile never reached us
+        drain_socket();
+        node.pending.clear();
+    }
+
+    inline auto is_channel_busy() -> bool
+    {
+        using namespace detail;
+        apply_due_events();
+        drain_socket();
+        return node.has_heard && is_before(static_cast<uint32_t>(now_ms()), node.last_heard_ms + node.options.busy_ms);
+    }
+
+    inline auto record_reading(Id device_id) -> void
+    {
+        using namespace detail;
+        if (!is_in(node.round_sources, device_id))
+            node.round_sources.push_back(device_id);
+    }
+
+    inline auto end_round() -> void
+    {
+        using namespace detail;
+        node.rounds.push_back({scenario_ms(), static_cast<uint32_t>(node.round_sources.size())});
+        node.round_sources.clear();
+    }
+
+    inline auto print_report(std::FILE *file) -> void
+    {
+        using namespace detail;
+        std::fprintf(file, "%zu rounds\n", node.rounds.size());
+        for (const auto &event : node.events)
+        {
+            if (event.kind == Reboot || event.kind == Restore || event.kind == Heal)
+                continue;
+            std::fprintf(file, "%u ms %s %u: ", event.at_ms, event_names[event.kind], event.a);
+            // Best round before the fault is what the mesh should get back to
+            uint32_t baseline = 0;
+            auto round = node.rounds.begin();
+            for (; round != node.rounds.end() && round->ended_ms <= event.at_ms; round++)
+                baseline = round->readings > baseline ? round->readings : baseline;
+            if (round == node.rounds.begin())
+            {
+                std::fprintf(file, "no round before the fault\n");
+                continue;
+            }
+            uint32_t lost = 0;
+            auto is_recovered = false;
+            for (; round != node.rounds.end() && !is_recovered; round++)
+            {
+                const auto down = nodes_down_at(round->ended_ms);
+                const auto expected = baseline > down ? baseline - down : 0;
+                // The round the fault hit in got going before it, so it proves nothing
+                const auto is_after_fault = std::prev(round)->ended_ms > event.at_ms;
+                is_recovered = is_after_fault && round->readings >= expected;
+                if (is_recovered)
+                    std::fprintf(file, "recovered after %u ms, ", round->ended_ms - event.at_ms);
+                else if (round->readings < expected)
+                    lost += expected - round->readings;
+            }
+            if (!is_recovered)
+                std::fprintf(file, "not recovered, ");
+            std::fprintf(file, "%u readings lost\n", lost);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,303 @@
+// Runs a few real rounds per Config mode on the emulation and checks that
+// every reading arrives and that every node's run() returns. Linux only:
+//   g++ -std=c++17 -O1 -o emulation_test emulation_test.cpp && ./emulation_test
+// Pass mode names to run only those. Exits with 1 when any mode fails.
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "emulation.hpp"
+
+using namespace minimesh;
+namespace emulation = minimesh::emulation;
+
+constexpr uint32_t node_count = 7;
+constexpr uint32_t rounds = 3;     // run() must return this often on every node
+constexpr uint32_t max_rounds = 12; // Rounds the collector gets to make that happen over lossy links
+constexpr uint32_t data_length = 16;
+constexpr uint32_t mode_timeout_ms = 90000;
+constexpr double lossy_link_loss = 0.1;
+// Three ranks deep. Node 5 only hears 3 and node 7 only hears 5, so a relay
+// that goes quiet cuts off a whole branch.
+constexpr const char *topology =
+    "1 2\n"
+    "1 3\n"
+    "2 3\n"
+    "2 4\n"
+    "3 5\n"
+    "4 6\n"
+    "5 7\n";
+
+// Shared by all node processes of a run
+struct Results
+{
+    uint32_t readings[max_rounds]; // Bit per device the collector heard from in that round
+    uint32_t runs[node_count + 1]; // Times run() returned, by node
+};
+Results *results;
+uint32_t round_index;
+Reliability reliability; // Of every sensor's data
+
+auto on_data(Id device_id, ConstBytes) -> void
+{
+    if (round_index < max_rounds && device_id <= node_count)
+        results->readings[round_index] |= 1u << device_id;
+}
+auto on_sample(Id device_id, uint8_t, ConstBytes) -> void
+{
+    on_data(device_id, {});
+}
+auto produce(Bytes buffer) -> void
+{
+    for (uint32_t i = 0; i < buffer.len; i++)
+        buffer.buf[i] = static_cast<uint8_t>(i);
+}
+auto transmit_batch(const Bytes *frames, uint32_t count) -> void
+{
+    for (uint32_t i = 0; i < count; i++)
+        emulation::transmit({frames[i].buf, frames[i].len});
+}
+auto set_data_rate(uint8_t) -> void {}
+uint8_t checkpoint[64];
+uint32_t checkpoint_length;
+auto save_state(ConstBytes bytes) -> void
+{
+    checkpoint_length = bytes.len < sizeof(checkpoint) ? bytes.len : sizeof(checkpoint);
+    std::memcpy(checkpoint, bytes.buf, checkpoint_length);
+}
+auto load_state(Bytes buffer) -> uint32_t
+{
+    const auto length = checkpoint_length < buffer.len ? checkpoint_length : buffer.len;
+    std::memcpy(buffer.buf, checkpoint, length);
+    return length;
+}
+
+constexpr uint16_t rates_kbps[] = {250, 1000, 2000};
+constexpr Stream streams[] = {{1, 2, 1, produce}, {2, 4, 1, produce}};
+
+struct BatchTransport : BasicTransport
+{
+    static constexpr TransmitBatchFunc *transmit_batch = ::transmit_batch;
+};
+struct MultiRateTransport : BasicTransport
+{
+    static constexpr SetDataRateFunc *set_data_rate = ::set_data_rate;
+    static constexpr const uint16_t *data_rates_kbps = rates_kbps;
+    static constexpr uint8_t data_rate_count = 3;
+};
+
+struct PipelinedConfig : DefaultConfig
+{
+    static constexpr bool pipelined = true;
+};
+struct SuppressedBeaconConfig : DefaultConfig
+{
+    static constexpr uint32_t beacon_redundancy = 1;
+};
+struct CheckpointConfig : DefaultConfig
+{
+    static constexpr SaveStateFunc *save_state = ::save_state;
+    static constexpr LoadStateFunc *load_state = ::load_state;
+};
+struct StaggeredConfig : DefaultConfig
+{
+    static constexpr bool staggered = true;
+    static constexpr ClockFunc *clock = emulation::clock;
+};
+struct ReceiverInitiatedConfig : DefaultConfig
+{
+    static constexpr bool receiver_initiated = true;
+};
+struct ProduceConfig : DefaultConfig
+{
+    static constexpr ProduceFunc *produce = ::produce;
+};
+struct StreamConfig : DefaultConfig
+{
+    static constexpr const Stream *streams = ::streams;
+    static constexpr uint32_t stream_count = 2;
+    static constexpr StreamCallback *stream_callback = on_sample;
+};
+struct BurstConfig : DefaultConfig
+{
+    using Transport = BatchTransport;
+};
+struct RateConfig : DefaultConfig
+{
+    using Transport = MultiRateTransport;
+};
+struct RtsConfig : DefaultConfig
+{
+    static constexpr uint32_t rts_threshold = 16;
+};
+struct RtsClockConfig : RtsConfig
+{
+    static constexpr ClockFunc *clock = emulation::clock; // Serves only what is left of an overheard CTS
+};
+struct ImplicitAckConfig : DefaultConfig
+{
+    static constexpr uint32_t implicit_ack_ms = 50;
+};
+struct OpportunisticConfig : DefaultConfig
+{
+    static constexpr uint32_t forwarding_candidates = 2;
+};
+
+// The collector never restarts from a checkpoint
+template <typename Config>
+struct CollectorConfig : Config
+{
+    static constexpr SaveStateFunc *save_state = nullptr;
+    static constexpr LoadStateFunc *load_state = nullptr;
+};
+
+auto are_sensors_done() -> bool
+{
+    for (Id id = 2; id <= node_count; id++)
+        if (__atomic_load_n(&results->runs[id], __ATOMIC_SEQ_CST) < rounds)
+            return false;
+    return true;
+}
+
+// Sensors run until they are killed, the collector until every sensor's
+// run() returned often enough or it ran out of rounds
+template <typename Config, Id id>
+auto run_node() -> void
+{
+    constexpr auto is_collector = id == 1;
+    using NodeConfig = std::conditional_t<is_collector, CollectorConfig<Config>, Config>;
+    const Handle<emulation::receive, emulation::transmit, emulation::sleep, emulation::is_channel_busy,
+                 id, is_collector ? 0 : data_length, is_collector, on_data, NodeConfig>
+        handle;
+    if constexpr (is_collector)
+    {
+        emulation::sleep(300000); // Let every node power up before the first beacon
+        for (round_index = 0; round_index < max_rounds && !are_sensors_done(); round_index++)
+        {
+            handle.run();
+            __atomic_add_fetch(&results->runs[id], 1, __ATOMIC_SEQ_CST);
+            emulation::sleep(300000);
+        }
+    }
+    else
+    {
+        handle.set_reliability(reliability);
+        while (true)
+        {
+            std::memset(handle.get_data_buffer(), id, data_length);
+            handle.run();
+            __atomic_add_fetch(&results->runs[id], 1, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+template <typename Config, size_t... ids>
+auto run_node(Id id, std::index_sequence<ids...>) -> void
+{
+    ((id == ids + 1 ? run_node<Config, ids + 1>() : void()), ...);
+}
+
+// Every node runs in its own process. Over lossless links every reading of
+// the first rounds must arrive, over lossy ones every run() must still return.
+template <typename Config>
+auto run_mode(const char *name, const char *topology_path, double loss) -> bool
+{
+    *results = {};
+    const auto start_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::system_clock::now().time_since_epoch())
+                              .count();
+    setenv("MINIMESH_EMULATION_START_MS", std::to_string(start_ms).c_str(), 1);
+    pid_t nodes[node_count + 1] = {};
+    for (Id id = 1; id <= node_count; id++)
+    {
+        nodes[id] = fork();
+        if (nodes[id] != 0)
+            continue;
+        emulation::Options options;
+        options.topology = topology_path;
+        options.loss = loss;
+        if (!emulation::init(id, options))
+            _exit(2);
+        run_node<Config>(id, std::make_index_sequence<node_count>{});
+        _exit(0);
+    }
+    auto is_timed_out = true;
+    for (uint32_t waited_ms = 0; waited_ms < mode_timeout_ms; waited_ms += 10)
+    {
+        if (waitpid(nodes[1], nullptr, WNOHANG) == nodes[1])
+        {
+            is_timed_out = false;
+            break;
+        }
+        usleep(10000);
+    }
+    for (Id id = 1; id <= node_count; id++)
+        kill(nodes[id], SIGKILL);
+    while (wait(nullptr) > 0)
+        ;
+    auto is_ok = !is_timed_out;
+    std::printf("%-24s %-9s", name, loss > 0 ? "lossy" : "lossless");
+    for (uint32_t round = 0; round < rounds; round++)
+    {
+        const auto heard = __builtin_popcount(results->readings[round]);
+        std::printf(" %u/%u", heard, node_count - 1);
+        is_ok = is_ok && (loss > 0 || heard == node_count - 1);
+    }
+    for (Id id = 2; id <= node_count; id++)
+        if (results->runs[id] < rounds)
+        {
+            std::printf(" node %u ran %u of %u rounds", id, results->runs[id], rounds);
+            is_ok = false;
+        }
+    std::printf(" %s\n", is_ok ? "ok" : "FAILED");
+    std::fflush(stdout);
+    return is_ok;
+}
+template <typename Config>
+auto test_mode(const char *name, int argc, char **argv, Reliability data_reliability = Reliability::Reliable) -> bool
+{
+    auto is_selected = argc <= 1;
+    for (auto i = 1; i < argc; i++)
+        is_selected = is_selected || std::string(argv[i]) == name;
+    if (!is_selected)
+        return true;
+    char path[] = "/tmp/minimesh_topology_XXXXXX";
+    const auto file = mkstemp(path);
+    if (file < 0 || write(file, topology, std::strlen(topology)) < 0)
+        return false;
+    close(file);
+    reliability = data_reliability;
+    const auto is_lossless_ok = run_mode<Config>(name, path, 0);
+    const auto is_lossy_ok = run_mode<Config>(name, path, lossy_link_loss);
+    unlink(path);
+    return is_lossless_ok && is_lossy_ok;
+}
+
+int main(int argc, char **argv)
+{
+    results = static_cast<Results *>(mmap(nullptr, sizeof(Results), PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (results == MAP_FAILED)
+        return 2;
+    auto is_ok = true;
+    is_ok = test_mode<DefaultConfig>("DefaultConfig", argc, argv) && is_ok;
+    is_ok = test_mode<PipelinedConfig>("PipelinedConfig", argc, argv) && is_ok;
+    is_ok = test_mode<SuppressedBeaconConfig>("SuppressedBeaconConfig", argc, argv) && is_ok;
+    is_ok = test_mode<CheckpointConfig>("CheckpointConfig", argc, argv) && is_ok;
+    is_ok = test_mode<StaggeredConfig>("StaggeredConfig", argc, argv) && is_ok;
+    is_ok = test_mode<DefaultConfig>("BestEffort", argc, argv, Reliability::BestEffort) && is_ok;
+    is_ok = test_mode<DefaultConfig>("LimitedRetry", argc, argv, Reliability::LimitedRetry) && is_ok;
+    is_ok = test_mode<StaggeredConfig>("StaggeredLimitedRetry", argc, argv, Reliability::LimitedRetry) && is_ok;
+    is_ok = test_mode<ReceiverInitiatedConfig>("ReceiverInitiatedConfig", argc, argv) && is_ok;
+    is_ok = test_mode<ProduceConfig>("ProduceConfig", argc, argv) && is_ok;
+    is_ok = test_mode<StreamConfig>("StreamConfig", argc, argv) && is_ok;
+    is_ok = test_mode<BurstConfig>("BurstConfig", argc, argv) && is_ok;
+    is_ok = test_mode<RateConfig>("RateConfig", argc, argv) && is_ok;
+    is_ok = test_mode<RtsConfig>("RtsConfig", argc, argv) && is_ok;
+    is_ok = test_mode<RtsClockConfig>("RtsClockConfig", argc, argv) && is_ok;
+    is_ok = test_mode<ImplicitAckConfig>("ImplicitAckConfig", argc, argv) && is_ok;
+    is_ok = test_mode<OpportunisticConfig>("OpportunisticConfig", argc, argv) && is_ok;
+    return is_ok ? 0 : 1;
+}
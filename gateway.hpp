@@ -0,0 +1,476 @@
+#ifndef MINIMESH_GATEWAY_HPP
+#define MINIMESH_GATEWAY_HPP
+// Linux only. Gateway I/O for many radio links at once. One event loop thread
+// serves every link through a single io_uring: reads go to registered buffers
+// and stay posted on every link, writes are submitted together with the next
+// wait for completions.
+//
+// Handle::run() blocks inside receive(), sleep() and transmit() until its
+// round is over, so each link's collector runs as a coroutine on the event
+// loop thread instead of on a thread of its own. The adapters below suspend
+// it, and the loop resumes it as soon as a frame for it completes or its
+// timeout expires. Frames thus go straight from the ring into the collector's
+// state machine, without a lock or a kernel context switch.
+//
+// Endpoints must deliver one frame per read: UDP sockets, or serial dongles
+// whose driver frames reads.
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include "minimesh2.hpp"
+
+namespace minimesh::gateway
+{
+    /* -------------------------------------------------------------------------- */
+    /*                               User Interface                               */
+    /* -------------------------------------------------------------------------- */
+    static constexpr uint32_t max_links = 64;
+    static constexpr uint32_t max_frame_size = 2048;
+    static constexpr uint32_t inbox_length = 8; // Frames a link buffers for its collector
+    static constexpr uint32_t outbox_length = 4; // Frames a link can have in flight to its radio
+    static constexpr uint32_t collector_stack_size = 64 * 1024;
+
+    // Register an endpoint and the collector that serves it before start(), for
+    // example a loop around Handle::run() with the adapters of this link.
+    // Returns its link number, the template argument of the adapters below, or
+    // -1 when there are too many links.
+    auto add_link(int fd, void (*collector)()) -> int;
+    // Set up the ring and start the event loop thread, which runs every collector
+    auto start() -> bool;
+    auto stop() -> void;
+    // Adapters for Handle's template parameters, one set per link. Only a
+    // collector running on the event loop may call them.
+    template <uint32_t link>
+    auto receive(uint32_t timeout_ms) -> Bytes;
+    template <uint32_t link>
+    auto transmit(ConstBytes bytes) -> void;
+    template <uint32_t link>
+    auto sleep(uint32_t duration_us) -> void;
+    // Dongles do their own channel access
+    template <uint32_t link>
+    auto is_channel_busy() -> bool
+    {
+        return false;
+    }
+
+    /* -------------------------------------------------------------------------- */
+    /*                               Implementation                               */
+    /* -------------------------------------------------------------------------- */
+    namespace detail
+    {
+        static constexpr uint32_t ring_entries = 512;
+        static_assert(max_links * (1 + outbox_length) + 1 <= ring_entries,
+                      "Every posted read and write must fit in the ring at once");
+        enum Operation : uint64_t
+        {
+            Read,
+            Write,
+            Wake,
+        };
+        inline auto user_data(Operation operation, uint32_t link, uint32_t slot) -> uint64_t
+        {
+            return (static_cast<uint64_t>(operation) << 56) | (static_cast<uint64_t>(link) << 32) | slot;
+        }
+
+        using Clock = std::chrono::steady_clock;
+        // What a suspended collector waits for
+        enum class Wait
+        {
+            Running,
+            Frame, // Or the deadline
+            Time,
+            Slot, // In the outbox
+            Done,
+        };
+
+        struct Frame
+        {
+            uint32_t length;
+            uint8_t buffer[max_frame_size];
+        };
+        struct Link
+        {
+            int fd;
+            bool is_open; // Like everything below, only touched on the event loop thread
+            Frame inbox[inbox_length];
+            uint32_t inbox_head;
+            uint32_t inbox_count;
+            Frame current;                       // Last frame handed out by receive()
+            uint8_t read_buffer[max_frame_size]; // Registered, index link
+            Frame outbox[outbox_length];         // Registered, index max_links + link * outbox_length + slot
+            bool is_slot_busy[outbox_length];
+            void (*collector)();
+            ucontext_t context;
+            Wait wait;
+            Clock::time_point deadline;
+            alignas(16) uint8_t stack[collector_stack_size];
+        };
+        struct Ring
+        {
+            int fd = -1;
+            unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+            unsigned *cq_head, *cq_tail, *cq_mask;
+            io_uring_sqe *sqes;
+            io_uring_cqe *cqes;
+            unsigned sq_entries;
+            unsigned local_tail; // Submission entries prepared so far
+            unsigned to_submit;
+        };
+        struct Gateway
+        {
+            Link links[max_links];
+            uint32_t link_count;
+            Ring ring;
+            int wake_fd = -1; // Lets stop() interrupt the wait for completions
+            uint64_t wake_value;
+            ucontext_t loop_context;
+            std::atomic<bool> is_running;
+            std::thread thread;
+        };
+        inline Gateway gateway;
+
+        inline auto setup(Ring &ring) -> bool
+        {
+            io_uring_params params = {};
+            ring.fd = static_cast<int>(::syscall(__NR_io_uring_setup, ring_entries, &params));
+            if (ring.fd < 0 || (params.features & IORING_FEAT_EXT_ARG) == 0)
+                return false;
+            auto sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            auto cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const auto is_single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (is_single_mmap)
+                sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+            const auto sq = static_cast<uint8_t *>(
+                ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING));
+            if (sq == MAP_FAILED)
+                return false;
+            auto cq = sq;
+            if (!is_single_mmap)
+            {
+                cq = static_cast<uint8_t *>(
+                    ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING));
+                if (cq == MAP_FAILED)
+                    return false;
+            }
+            const auto sqes = ::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED)
+                return false;
+            ring.sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            ring.sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            ring.sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            ring.sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            ring.cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            ring.cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            ring.cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            ring.cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+            ring.sqes = static_cast<io_uring_sqe *>(sqes);
+            ring.sq_entries = params.sq_entries;
+            ring.local_tail = *ring.sq_tail;
+            ring.to_submit = 0;
+            return true;
+        }
+        // Hand prepared entries to the kernel, waiting for at least min_complete
+        // completions, or until timeout when given
+        inline auto enter(Ring &ring, unsigned min_complete, const __kernel_timespec *timeout = nullptr) -> void
+        {
+            __atomic_store_n(ring.sq_tail, ring.local_tail, __ATOMIC_RELEASE);
+            io_uring_getevents_arg arg = {};
+            arg.ts = reinterpret_cast<uint64_t>(timeout);
+            const auto flags = (min_complete > 0 ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG;
+            const auto submitted =
+                ::syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, min_complete, flags, &arg, sizeof(arg));
+            if (submitted > 0)
+                ring.to_submit -= static_cast<unsigned>(submitted);
+        }
+        inline auto next_sqe(Ring &ring) -> io_uring_sqe *
+        {
+            if (ring.local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries)
+                enter(ring, 0);
+            const auto index = ring.local_tail & *ring.sq_mask;
+            auto sqe = &ring.sqes[index];
+            *sqe = {};
+            ring.sq_array[index] = index;
+            ring.local_tail++;
+            ring.to_submit++;
+            return sqe;
+        }
+        inline auto prepare(uint8_t opcode, int fd, void *buf, uint32_t len, uint16_t buf_index, uint64_t data) -> void
+        {
+            auto sqe = next_sqe(gateway.ring);
+            sqe->opcode = opcode;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(buf);
+            sqe->len = len;
+            sqe->off = static_cast<uint64_t>(-1); // Current position, as for read() and write()
+            sqe->buf_index = buf_index;
+            sqe->user_data = data;
+        }
+        inline auto post_read(uint32_t link) -> void
+        {
+            auto &l = gateway.links[link];
+            prepare(IORING_OP_READ_FIXED, l.fd, l.read_buffer, max_frame_size, static_cast<uint16_t>(link),
+                    user_data(Read, link, 0));
+        }
+        inline auto post_wake() -> void
+        {
+            prepare(IORING_OP_READ, gateway.wake_fd, &gateway.wake_value, sizeof(gateway.wake_value), 0,
+                    user_data(Wake, 0, 0));
+        }
+        inline auto post_write(uint32_t link, uint32_t slot) -> void
+        {
+            auto &l = gateway.links[link];
+            auto &frame = l.outbox[slot];
+            prepare(IORING_OP_WRITE_FIXED, l.fd, frame.buffer, frame.length,
+                    static_cast<uint16_t>(max_links + link * outbox_length + slot), user_data(Write, link, slot));
+        }
+
+        // Switch between the event loop and a collector. The collector gets
+        // the CPU back exactly where it suspended itself.
+        inline auto resume(uint32_t link) -> void
+        {
+            auto &l = gateway.links[link];
+            l.wait = Wait::Running;
+            ::swapcontext(&gateway.loop_context, &l.context);
+        }
+        inline auto suspend(Link &l, Wait wait) -> void
+        {
+            l.wait = wait;
+            ::swapcontext(&l.context, &gateway.loop_context);
+        }
+        inline auto run_collector(int link) -> void
+        {
+            auto &l = gateway.links[link];
+            l.collector();
+            l.wait = Wait::Done; // Returns to the loop through uc_link
+        }
+        inline auto spawn(uint32_t link) -> bool
+        {
+            auto &l = gateway.links[link];
+            if (::getcontext(&l.context) < 0)
+                return false;
+            l.context.uc_stack = {l.stack, 0, sizeof(l.stack)};
+            l.context.uc_link = &gateway.loop_context;
+            ::makecontext(&l.context, reinterpret_cast<void (*)()>(run_collector), 1, static_cast<int>(link));
+            return true;
+        }
+
+        inline auto deliver(uint32_t link, int32_t result) -> void
+        {
+            auto &l = gateway.links[link];
+            // End of file means the dongle went away, reading again would return at once forever
+            if (result == 0 || (result < 0 && result != -EAGAIN && result != -EINTR))
+            {
+                l.is_open = false;
+                return;
+            }
+            if (result > 0 && l.inbox_count < inbox_length) // Otherwise the collector fell behind, drop like a full radio FIFO
+            {
+                auto &frame = l.inbox[(l.inbox_head + l.inbox_count) % inbox_length];
+                frame.length = static_cast<uint32_t>(result);
+                for (uint32_t i = 0; i < frame.length; i++)
+                    frame.buffer[i] = l.read_buffer[i];
+                l.inbox_count++;
+            }
+            post_read(link);
+            if (l.wait == Wait::Frame && l.inbox_count > 0)
+                resume(link);
+        }
+        inline auto complete_write(uint32_t link, uint32_t slot) -> void
+        {
+            auto &l = gateway.links[link];
+            l.is_slot_busy[slot] = false;
+            if (l.wait == Wait::Slot)
+                resume(link);
+        }
+        // Resume every collector whose timeout expired. Returns how long the
+        // loop may wait for completions before the next one does.
+        inline auto resume_expired() -> Clock::duration
+        {
+            const auto is_waiting_for_time = [](const Link &l) {
+                return l.wait == Wait::Frame || l.wait == Wait::Time;
+            };
+            for (uint32_t link = 0; link < gateway.link_count; link++)
+                if (is_waiting_for_time(gateway.links[link]) && gateway.links[link].deadline <= Clock::now())
+                    resume(link);
+            // Only now, a resumed collector may have set a new deadline
+            auto next = Clock::duration::max();
+            const auto now = Clock::now();
+            for (uint32_t link = 0; link < gateway.link_count; link++)
+            {
+                const auto &l = gateway.links[link];
+                if (is_waiting_for_time(l) && l.deadline - now < next)
+                    next = l.deadline > now ? l.deadline - now : Clock::duration::zero();
+            }
+            return next;
+        }
+        inline auto run() -> void
+        {
+            auto &ring = gateway.ring;
+            for (uint32_t link = 0; link < gateway.link_count; link++)
+                post_read(link);
+            post_wake();
+            for (uint32_t link = 0; link < gateway.link_count; link++)
+                resume(link);
+            while (gateway.is_running)
+            {
+                const auto next = resume_expired();
+                if (next == Clock::duration::max())
+                    enter(ring, 1);
+                else
+                {
+                    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next).count();
+                    const __kernel_timespec timeout = {ns / 1000000000, ns % 1000000000};
+                    enter(ring, 1, &timeout);
+                }
+                auto head = *ring.cq_head;
+                const auto tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++)
+                {
+                    const auto cqe = ring.cqes[head & *ring.cq_mask];
+                    // Free the entry first, the collectors resumed below may submit more
+                    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+                    const auto link = static_cast<uint32_t>(cqe.user_data >> 32) & 0xffffff;
+                    switch (static_cast<Operation>(cqe.user_data >> 56))
+                    {
+                    case Read:
+                        deliver(link, cqe.res);
+                        break;
+                    case Write:
+                        complete_write(link, static_cast<uint32_t>(cqe.user_data));
+                        break;
+                    case Wake:
+                        post_wake();
+                        break;
+                    }
+                }
+            }
+        }
+        inline auto wake() -> void
+        {
+            const uint64_t one = 1;
+            [[maybe_unused]] const auto written = ::write(gateway.wake_fd, &one, sizeof(one));
+        }
+    }
+
+    inline auto add_link(int fd, void (*collector)()) -> int
+    {
+        using namespace detail;
+        if (gateway.link_count == max_links || gateway.is_running)
+            return -1;
+        auto &link = gateway.links[gateway.link_count];
+        link.fd = fd;
+        link.is_open = true;
+        link.collector = collector;
+        return static_cast<int>(gateway.link_count++);
+    }
+
+    inline auto start() -> bool
+    {
+        using namespace detail;
+        if (!setup(gateway.ring))
+            return false;
+        gateway.wake_fd = ::eventfd(0, 0);
+        if (gateway.wake_fd < 0)
+            return false;
+        // Register every read buffer, then every outbox slot
+        static iovec buffers[max_links * (1 + outbox_length)];
+        for (uint32_t link = 0; link < max_links; link++)
+        {
+            auto &l = gateway.links[link];
+            buffers[link] = {l.read_buffer, max_frame_size};
+            for (uint32_t slot = 0; slot < outbox_length; slot++)
+                buffers[max_links + link * outbox_length + slot] = {l.outbox[slot].buffer, max_frame_size};
+        }
+        if (::syscall(__NR_io_uring_register, gateway.ring.fd, IORING_REGISTER_BUFFERS, buffers,
+                      max_links * (1 + outbox_length)) < 0)
+            return false;
+        for (uint32_t link = 0; link < gateway.link_count; link++)
+            if (!spawn(link))
+                return false;
+        gateway.is_running = true;
+        gateway.thread = std::thread(run);
+        return true;
+    }
+
+    inline auto stop() -> void
+    {
+        using namespace detail;
+        gateway.is_running = false;
+        wake();
+        if (gateway.thread.joinable())
+            gateway.thread.join();
+        ::close(gateway.ring.fd);
+        ::close(gateway.wake_fd);
+    }
+
+    // A closed link hears nothing, like a radio that is switched off
+    template <uint32_t link>
+    auto receive(uint32_t timeout_ms) -> Bytes
+    {
+        static_assert(link < max_links, "No such link");
+        using namespace detail;
+        auto &l = gateway.links[link];
+        if (l.inbox_count == 0)
+        {
+            l.deadline = timeout_ms == 0 ? Clock::time_point::max() : Clock::now() + std::chrono::milliseconds(timeout_ms);
+            suspend(l, Wait::Frame);
+        }
+        if (l.inbox_count == 0)
+            return {l.current.buffer, 0};
+        const auto &frame = l.inbox[l.inbox_head];
+        l.current.length = frame.length;
+        for (uint32_t i = 0; i < frame.length; i++)
+            l.current.buffer[i] = frame.buffer[i];
+        l.inbox_head = (l.inbox_head + 1) % inbox_length;
+        l.inbox_count--;
+        return {l.current.buffer, l.current.length};
+    }
+
+    template <uint32_t link>
+    auto transmit(ConstBytes bytes) -> void
+    {
+        static_assert(link < max_links, "No such link");
+        using namespace detail;
+        auto &l = gateway.links[link];
+        if (bytes.len > max_frame_size || !l.is_open)
+            return;
+        // Wait for the radio to take one of our earlier frames
+        uint32_t slot = 0;
+        while (true)
+        {
+            for (slot = 0; slot < outbox_length && l.is_slot_busy[slot]; slot++)
+                ;
+            if (slot < outbox_length)
+                break;
+            suspend(l, Wait::Slot);
+        }
+        l.is_slot_busy[slot] = true;
+        auto &frame = l.outbox[slot];
+        frame.length = bytes.len;
+        for (uint32_t i = 0; i < bytes.len; i++)
+            frame.buffer[i] = bytes.buf[i];
+        post_write(link, slot); // Submitted with the loop's next wait
+    }
+
+    // Lets the other collectors run meanwhile
+    template <uint32_t link>
+    auto sleep(uint32_t duration_us) -> void
+    {
+        static_assert(link < max_links, "No such link");
+        using namespace detail;
+        auto &l = gateway.links[link];
+        l.deadline = Clock::now() + std::chrono::microseconds(duration_us);
+        suspend(l, Wait::Time);
+    }
+}
+
+#endif
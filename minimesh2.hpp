@@ -9,17 +9,119 @@ namespace minimesh
     /*                               User Interface                               */
     /* -------------------------------------------------------------------------- */
     using Id = uint32_t;
+    // Returns the next frame heard, or an empty one once timeout_ms passes
+    // without any. A timeout of 0 waits until a frame arrives.
     using ReceiveFunc = auto(uint32_t timeout_ms) -> Bytes;
     using TransmitFunc = auto(ConstBytes bytes) -> void;
     using SleepFunc = auto(uint32_t duration_us) -> void;
     using IsChannelBusyFunc = auto() -> bool;
+    using ClockFunc = auto() -> uint32_t; // Milliseconds since any fixed point, may wrap
     using CollectorCallback = auto(Id device_id, ConstBytes data) -> void;
     constexpr CollectorCallback *no_callback =
         reinterpret_cast<CollectorCallback *>(NULL);
 
+    enum class TxStatus
+    {
+        Acked,       // Receiver acknowledged the frame
+        NoAck,       // Frame went out but no acknowledgement came back
+        ChannelBusy, // Radio gave up on channel access
+    };
+    // How hard the mesh tries to get a data packet to the parent, at every hop
+    enum class Reliability : uint8_t
+    {
+        Reliable,     // Acknowledged and retried until it gets through
+        BestEffort,   // Sent once, nobody acknowledges it
+        LimitedRetry, // A few acknowledged attempts, dropped by relays past its deadline
+    };
+    // Sends a unicast frame to receiver_id and reports how it went
+    using TransmitAckedFunc = auto(ConstBytes bytes, Id receiver_id) -> TxStatus;
+    // Switches the radio to one of Transport::data_rates_kbps, by index, for the
+    // frames that follow. The radio is assumed to start at index 0 and to
+    // receive at any rate.
+    using SetDataRateFunc = auto(uint8_t rate_index) -> void;
+    // Sends count frames back to back after a single channel access, e.g. through a TX FIFO.
+    // The frames must be left unchanged.
+    using TransmitBatchFunc = auto(const Bytes *frames, uint32_t count) -> void;
+    // Keep a routing checkpoint across resets, e.g. in retained RAM or flash
+    using SaveStateFunc = auto(ConstBytes bytes) -> void;
+    // Copy the last saved checkpoint into buffer and return its length (0 if there is none)
+    using LoadStateFunc = auto(Bytes buffer) -> uint32_t;
+    // Write a fresh reading into buffer, called just before our data frame goes out
+    using ProduceFunc = auto(Bytes buffer) -> void;
+    // A logical data channel of a sensor with its own sample size and rate
+    struct Stream
+    {
+        uint8_t stream_id;
+        uint8_t length;       // Bytes per sample
+        uint32_t period;      // Sent every this many rounds, starting with the first
+        ProduceFunc *produce; // Writes a sample of length bytes
+    };
+    // Called by the collector for every stream sample it receives
+    using StreamCallback = auto(Id device_id, uint8_t stream_id, ConstBytes data) -> void;
+
+    // What the radio does on its own. The default describes a plain radio, so
+    // acknowledgements and retries are done in software. Radios that ack (and
+    // possibly retry) unicast frames in hardware, like most 802.15.4
+    // transceivers, or radios with a different frame size, should derive from
+    // this and override what differs.
+    struct BasicTransport
+    {
+        static constexpr uint32_t mtu = 255;          // Largest frame the radio sends, also sizes every relay slot
+        static constexpr bool hardware_ack = false;   // Link layer acks unicast frames
+        static constexpr bool hardware_retry = false; // Link layer retransmits until acked or out of attempts
+        static constexpr TransmitAckedFunc *transmit_acked = nullptr;
+        static constexpr TransmitBatchFunc *transmit_batch = nullptr; // Lets relays forward bursts
+        // Bitrates the radio supports, most robust first. With more than one,
+        // data to the parent adapts its rate and everything else uses the first.
+        static constexpr SetDataRateFunc *set_data_rate = nullptr;
+        static constexpr const uint16_t *data_rates_kbps = nullptr;
+        static constexpr uint8_t data_rate_count = 1;
+        static constexpr uint16_t bitrate_kbps = 250; // Of the only rate, when data_rates_kbps is not given
+    };
+
+    // Tuning knobs. Derive from this and override the members you care about.
+    struct DefaultConfig
+    {
+        static constexpr uint32_t relay_queue_length = 4;   // Frames a relay can buffer for its parent
+        static constexpr uint32_t max_children = 16;        // Children a relay keeps track of
+        static constexpr uint32_t credit_timeout_ms = 1000; // How long to wait for credit before sending anyway
+        static constexpr bool weight_by_subtree = true;     // Give bigger subtrees a bigger share of the relay
+        static constexpr bool pipelined = false;            // Send own data right after joining, admit children meanwhile
+        static constexpr uint32_t beacon_redundancy = 0;    // Skip our beacon after overhearing this many as good (0 never skips)
+        static constexpr uint32_t beacon_listen_ms = 20;    // Longest time spent overhearing before deciding to beacon
+        static constexpr uint32_t solicit_interval_ms = 500; // Ask for a parent this often while unjoined (0 waits for beacons)
+        static constexpr uint32_t beacon_period_ms = 1000;  // Repeat our beacon after this much quiet while serving children
+        using Transport = BasicTransport;                   // Capabilities of the radio
+        static constexpr SaveStateFunc *save_state = nullptr; // Warm restart hooks, both or neither
+        static constexpr LoadStateFunc *load_state = nullptr;
+        static constexpr ProduceFunc *produce = nullptr;    // Lazy sampling instead of filling get_data_buffer() before run()
+        static constexpr const Stream *streams = nullptr;   // Sensors: several channels packed into data_length instead
+        static constexpr uint32_t stream_count = 0;
+        static constexpr StreamCallback *stream_callback = nullptr; // Collector: split frames into stream samples
+        static constexpr uint32_t limited_retry_attempts = 3;  // Attempts per hop for LimitedRetry packets
+        static constexpr uint32_t limited_retry_deadline_ms = 500; // Time a LimitedRetry packet may wait in a relay (needs clock)
+        static constexpr bool staggered = false;            // D-MAC style data phase, radio on only in our slots
+        static constexpr ClockFunc *clock = nullptr;        // Required by the staggered schedule
+        static constexpr uint32_t slot_ms = 100;            // Length of one receive slot
+        static constexpr uint32_t max_depth = 8;            // Deepest rank the schedule has slots for
+        static constexpr uint32_t formation_ms = 1000;      // Time the tree gets to form before the data phase
+        static constexpr uint32_t max_missed_slots = 2;     // Slots in a row a child with credit may stay silent before we stop waiting for it
+        static constexpr bool receiver_initiated = false;   // Children send data only right after a probe from their parent
+        static constexpr uint32_t probe_period_ms = 150;    // Probe this often while no child sends data
+        static constexpr uint32_t max_burst = 4;            // Frames per burst when the transport can batch
+        static constexpr uint32_t rate_window = 16;         // Attempts between updates of the rate statistics
+        static constexpr uint32_t rate_sample_interval = 10; // Deliveries between tries of a rate other than the best
+        static constexpr uint32_t rts_threshold = 0;        // Data of at least this many bytes reserves the channel first (0 never)
+        static constexpr uint16_t rts_guard_ms = 2;         // Turnaround a CTS reserves on top of the long frame and its ack
+        static constexpr uint32_t implicit_ack_ms = 0;      // Overhear the parent forward our data for this long instead of an ack (0 always acks)
+        static constexpr uint32_t forwarding_candidates = 0; // Closer neighbours our data lists to forward it when the parent misses it (0 only the parent)
+        static constexpr uint32_t candidate_delay_ms = 5;   // Each listed candidate waits this much longer before taking a frame
+    };
+
     template <ReceiveFunc *receive, TransmitFunc *transmit, SleepFunc *sleep,
               IsChannelBusyFunc *is_channel_busy, Id id, uint32_t data_length,
-              bool is_collector, CollectorCallback *collector_callback = no_callback>
+              bool is_collector, CollectorCallback *collector_callback = no_callback,
+              typename Config = DefaultConfig>
     struct Handle
     {
 
@@ -38,7 +140,16 @@ namespace minimesh
         auto get_data_buffer() const -> uint8_t *
         {
             static_assert(!is_collector, "data buffer is only used for sensors");
-            return data_packet->data;
+            return data_packet->data + sizeof(DataInfo);
+        }
+
+        // Delivery class of our data from the next run() on. Telling the parent
+        // that our subtree is done always goes reliably, after expendable data
+        // as a separate EndOfData.
+        auto set_reliability(Reliability reliability) const -> void
+        {
+            static_assert(!is_collector, "the collector sends no data");
+            state->reliability = reliability;
         }
 
         ;
@@ -51,20 +162,127 @@ namespace minimesh
             IAmParent,
             IAmChild,
             Data,
-            EndOfData,
+            EndOfData, // Bare subtree completion marker, when no data packet is left to carry it
             Ack,
+            Credit,
+            SolicitParent, // Broadcast by a node that missed the beacons, answered with a unicast IAmParent
+            Probe,         // Receiver-initiated mode: the transmitter is listening for data right now
+            BlockAck,      // Confirms the frames of a burst at once
+            Rts,           // Asks the parent to reserve the channel for a long frame
+            Cts,           // Parent's answer, overhearing children stay silent meanwhile
         };
-        static constexpr uint32_t max_packet_size = 255;
-        static constexpr uint32_t header_size = sizeof(MsgType) + sizeof(uint32_t) + sizeof(uint32_t);
-        static constexpr uint32_t max_data_length = max_packet_size - header_size;
+        using Transport = typename Config::Transport;
+        static constexpr uint32_t max_packet_size = Transport::mtu;
+        static constexpr uint32_t header_size = sizeof(MsgType) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t);
+        // Data packets start with a DataInfo, the payload follows
+        struct DataInfo
+        {
+            Id source_id;          // Id of the device that produced the data
+            uint16_t subtree_size; // Devices routing through the transmitter, including itself
+            uint16_t flags;        // DataFlags
+        };
+        // With streams the payload is a sequence of records, each a RecordHeader and its sample
+        struct RecordHeader
+        {
+            uint8_t stream_id;
+            uint8_t length;
+        };
+        enum DataFlags : uint16_t
+        {
+            LastData = 1 << 0,        // Source has nothing more to send this round
+            SubtreeComplete = 1 << 1, // Transmitter and all its descendants are done, valid for one hop only
+            BestEffort = 1 << 2,      // Reliability::BestEffort, neither acknowledged nor retried
+            LimitedRetry = 1 << 3,    // Reliability::LimitedRetry
+            Burst = 1 << 4,           // Part of a burst, confirmed by a block ack
+            MoreInBurst = 1 << 5,     // Another frame of the burst follows, hold the block ack
+            BurstToggle = 1 << 6,     // Flips with every new burst, so retransmissions are recognised
+            HasCandidates = 1 << 7,   // Ranked candidate forwarders follow the payload, their count in the last byte
+        };
+        // Position in the burst is kept in the high byte of the flags
+        static constexpr uint32_t burst_position_shift = 8;
+        static constexpr uint16_t burst_flags = DataFlags::Burst | DataFlags::MoreInBurst | DataFlags::BurstToggle | 0xff00;
+        static constexpr uint32_t data_header_size = header_size + sizeof(DataInfo);
+        static constexpr uint32_t credit_packet_size = header_size + sizeof(uint8_t);
+        static constexpr uint32_t beacon_packet_size = credit_packet_size + sizeof(uint8_t) + sizeof(uint16_t);
+        static constexpr uint32_t block_ack_packet_size = credit_packet_size + sizeof(uint8_t);
+        static constexpr uint32_t reservation_packet_size = header_size + sizeof(uint16_t);
+        static constexpr uint32_t max_data_length = max_packet_size - data_header_size;
+        static constexpr bool is_opportunistic = Config::forwarding_candidates > 0;
+        static constexpr uint32_t candidates_size = is_opportunistic ? Config::forwarding_candidates * sizeof(Id) + 1 : 0;
         static constexpr auto sleep_time = (id % 9000) + 1000;
         static constexpr Id broadcast = 0;
-        static_assert(data_length < max_packet_size, "Data cannot be longer than 255 bytes");
+        static constexpr uint8_t unlimited_credits = 255;
+        static constexpr uint8_t unknown_rate = 255;
+        // Slower than the 100 ms counting window, so repeated grants cannot keep
+        // a neighbour's count_children() open forever
+        static constexpr auto grant_resend_ms = 250;
+        static constexpr uint32_t slot_guard_ms = Config::slot_ms / 10;
+        static constexpr uint32_t relay_queue_length = Config::relay_queue_length;
+        static constexpr uint32_t max_children = Config::max_children;
+        static constexpr uint32_t no_slot = relay_queue_length;
+        static_assert(max_packet_size >= beacon_packet_size && max_packet_size > data_header_size,
+                      "MTU is too small for the protocol headers");
+        static_assert(data_length <= max_data_length, "Data does not fit in a single packet");
+        static_assert(relay_queue_length > 0 && relay_queue_length < unlimited_credits,
+                      "Relay queue length must fit in a credit counter");
+        static_assert(!Transport::hardware_retry || Transport::hardware_ack,
+                      "Hardware retries need hardware acks");
+        static_assert(!Transport::hardware_ack || Transport::transmit_acked != nullptr,
+                      "Hardware acks need a transmit function reporting TX status");
+        static_assert(Transport::transmit_batch == nullptr || !Transport::hardware_ack,
+                      "Bursts are confirmed by a block ack, which hardware acks cannot replace");
+        static_assert(Config::max_burst >= 1 && Config::max_burst <= 8, "Block acks confirm at most 8 frames");
+        static_assert(Config::implicit_ack_ms == 0 || !Transport::hardware_ack, "Hardware acks already cost no airtime");
+        static_assert(Config::implicit_ack_ms == 0 || (!Config::staggered && !Config::receiver_initiated),
+                      "Relays forward only in their parent's slot or after its probe, too late to overhear");
+        static_assert(data_length + candidates_size <= max_data_length, "Data and the candidate list do not fit in a single packet");
+        static_assert(Config::forwarding_candidates * Config::candidate_delay_ms < 30,
+                      "Candidates must answer before the transmitter gives up on its ack");
+        static_assert(!is_opportunistic || (!Transport::hardware_ack && !Config::staggered),
+                      "Candidates take a frame only after missing the parent's ack, awake and able to overhear it");
+        static constexpr uint8_t data_rate_count = Transport::data_rate_count;
+        static constexpr bool is_rate_adaptive = data_rate_count > 1;
+        static_assert(data_rate_count >= 1, "The radio needs at least one data rate");
+        static_assert(!is_rate_adaptive || (Transport::set_data_rate != nullptr && Transport::data_rates_kbps != nullptr),
+                      "Several data rates need set_data_rate and data_rates_kbps");
+        static_assert(Config::rate_window > 0 && Config::rate_sample_interval > 0, "Rate statistics need a window");
+        static constexpr bool has_checkpoint = Config::save_state != nullptr && Config::load_state != nullptr;
+        static_assert(has_checkpoint || (Config::save_state == nullptr && Config::load_state == nullptr),
+                      "Warm restart needs both save_state and load_state");
+        static_assert(!has_checkpoint || !is_collector, "The collector has no routing state to restore");
+        static_assert(!Config::staggered || Config::clock != nullptr, "The staggered schedule needs a clock");
+        static_assert(!Config::staggered || !Config::pipelined, "Pick either the staggered or the pipelined mode");
+        static_assert(!Config::staggered || !Config::receiver_initiated, "The staggered schedule already tells children when to send");
+        static_assert(!Config::receiver_initiated || Config::probe_period_ms > 100,
+                      "Probes must be slower than the 100 ms counting window or neighbours never stop counting");
+        static constexpr auto streams_length() -> uint32_t
+        {
+            uint32_t length = 0;
+            for (uint32_t i = 0; i < Config::stream_count; i++)
+                length += sizeof(RecordHeader) + Config::streams[i].length;
+            return length;
+        }
+        static constexpr auto are_stream_periods_set() -> bool
+        {
+            for (uint32_t i = 0; i < Config::stream_count; i++)
+                if (Config::streams[i].period == 0)
+                    return false;
+            return true;
+        }
+        // The collector only unpacks streams, so it may share the sensors' config
+        static_assert(is_collector || streams_length() <= data_length,
+                      "data_length must fit every stream falling due in the same round");
+        static_assert(is_collector || Config::stream_count == 0 || Config::produce == nullptr,
+                      "Streams bring their own producers");
+        static_assert(are_stream_periods_set(), "Every stream needs a period of at least one round");
+        static constexpr uint32_t checkpoint_magic = 0x4d4d4301; // "MMC" and layout version
+        static constexpr uint32_t unknown_epoch = 0;             // Stamped by nodes that did not learn the round yet
         struct Packet
         {
             MsgType msg_type;        // Type of message
             uint32_t transmitter_id; // Id of transmitting device
             uint32_t receiver_id;    // Id of intended receiver (0 means broadcast)
+            uint32_t epoch;          // Round the frame belongs to
             uint8_t data[];          // Custom data
         };
         struct Header
@@ -72,6 +290,7 @@ namespace minimesh
             MsgType msg_type;        // Type of message
             uint32_t transmitter_id; // Id of transmitting device
             uint32_t receiver_id;    // Id of intended receiver (0 means broadcast)
+            uint32_t epoch;          // Round the frame belongs to
             operator ConstBytes() const
             {
                 return {reinterpret_cast<const uint8_t *>(this), header_size};
@@ -85,6 +304,62 @@ namespace minimesh
                 return *reinterpret_cast<Packet *>(this);
             }
         };
+        // Ack, IAmParent and Credit packets carry the number of data packets
+        // the transmitter is willing to accept.
+        struct CreditPacket
+        {
+            MsgType msg_type;        // Type of message
+            uint32_t transmitter_id; // Id of transmitting device
+            uint32_t receiver_id;    // Id of intended receiver (0 means broadcast)
+            uint32_t epoch;          // Round the frame belongs to
+            uint8_t credits;         // Data packets the receiver may still send us
+            operator ConstBytes() const
+            {
+                return {reinterpret_cast<const uint8_t *>(this), credit_packet_size};
+            }
+        };
+        // IAmParent is a CreditPacket extended with the distance to the collector
+        struct BeaconPacket
+        {
+            MsgType msg_type;        // Type of message
+            uint32_t transmitter_id; // Id of transmitting device
+            uint32_t receiver_id;    // Id of intended receiver (0 means broadcast)
+            uint32_t epoch;          // Round the frame belongs to
+            uint8_t credits;         // Data packets the receiver may still send us
+            uint8_t rank;            // Hops between the transmitter and the collector
+            uint16_t data_phase_ms;  // Time left until the staggered data phase (0 when not scheduled)
+            operator ConstBytes() const
+            {
+                return {reinterpret_cast<const uint8_t *>(this), beacon_packet_size};
+            }
+        };
+        // BlockAck is a CreditPacket extended with the burst frames that arrived
+        struct BlockAckPacket
+        {
+            MsgType msg_type;        // Type of message
+            uint32_t transmitter_id; // Id of transmitting device
+            uint32_t receiver_id;    // Id of intended receiver (0 means broadcast)
+            uint32_t epoch;          // Round the frame belongs to
+            uint8_t credits;         // Data packets the receiver may still send us
+            uint8_t received;        // Bit n set when the frame at burst position n arrived
+            operator ConstBytes() const
+            {
+                return {reinterpret_cast<const uint8_t *>(this), block_ack_packet_size};
+            }
+        };
+        // Rts and Cts carry how long the channel is reserved
+        struct ReservationPacket
+        {
+            MsgType msg_type;        // Type of message
+            uint32_t transmitter_id; // Id of transmitting device
+            uint32_t receiver_id;    // Id of intended receiver (0 means broadcast)
+            uint32_t epoch;          // Round the frame belongs to
+            uint16_t reserve_ms;     // Time the exchange needs after this frame
+            operator ConstBytes() const
+            {
+                return {reinterpret_cast<const uint8_t *>(this), reservation_packet_size};
+            }
+        };
         struct ConstPacketWrapper
         {
             const Packet *packet;
@@ -104,174 +379,2004 @@ namespace minimesh
             Fail,
             Ok,
         };
+        // A wait that overheard frames must not extend, see time_left()
+        struct Deadline
+        {
+            uint32_t started_at; // Clock time the wait began, when there is a clock
+            uint32_t length_ms;
+            uint32_t spent_ms; // Without a clock, the timeouts handed to receive() so far
+        };
+        struct Child
+        {
+            Id child_id;
+            uint8_t credits;    // Data packets we promised to accept from this child
+            bool grant_pending; // Credit was granted out of band and not used yet
+            bool is_done;       // Child already sent its EndOfData
+            uint16_t subtree_size;
+            uint32_t head;    // First queued slot of this child
+            uint32_t tail;    // Last queued slot of this child
+            uint32_t queued;  // Number of slots queued by this child
+            uint32_t deficit; // Bytes this child may still forward in the current round
+            bool burst_toggle;       // BurstToggle of the child's current burst
+            uint8_t burst_received;  // Positions of the current burst we already have
+            bool is_implicitly_acked;  // Last data was left for the child to overhear in our forward
+            uint16_t implicit_checksum; // Of that data, repeats of it get an explicit ack
+            bool is_backup;             // Not our child, we only took over frames its parent missed
+            bool is_provisional;        // Restored from the checkpoint and not heard from since
+            bool is_heard;              // Staggered: sent us something in the current receive slot
+            uint8_t missed_slots;       // Staggered: receive slots in a row it stayed silent despite credit
+        };
+        // Closer neighbour heard beaconing, a candidate for forwarding our data
+        struct Candidate
+        {
+            Id candidate_id;
+            uint8_t rank;
+        };
+        // Minstrel style statistics of one data rate towards the parent
+        struct RateStats
+        {
+            uint16_t attempts;    // Transmissions in the current window
+            uint16_t successes;   // Of those, acknowledged
+            uint16_t probability; // Smoothed success probability, in 1/1024
+        };
+        struct RateControl
+        {
+            Id neighbour_id;     // Parent the statistics were collected with
+            RateStats rates[data_rate_count];
+            uint32_t window;     // Attempts recorded since the last update
+            uint32_t deliveries; // Packets delivered, to pace sampling
+            uint8_t next_sample; // Rate the next sampling attempt tries
+            uint8_t current;     // Rate the radio is set to
+        };
+        struct Slot
+        {
+            uint8_t buffer[max_packet_size];
+            uint32_t length;
+            uint32_t next;      // Next slot of the same child, or next free slot
+            uint32_t queued_at; // Clock time of arrival, for the LimitedRetry deadline
+        };
+        // Packets received from children, waiting to be forwarded to the parent.
+        // Slots are shared, but every child has its own FIFO of them and the
+        // FIFOs are served by deficit round-robin.
+        struct ForwardQueue
+        {
+            Slot slots[relay_queue_length];
+            uint32_t free_head;
+            uint32_t count;
+            uint32_t current; // Child the round-robin is currently serving
+        };
+        // Routing state that lets a node skip find_parent() after a reset
+        struct Checkpoint
+        {
+            uint32_t magic;
+            Id node_id;
+            Id parent_id;
+            uint8_t rank;
+            uint8_t child_count;
+            uint16_t checksum;
+            Id children[max_children];
+        };
+        struct State
+        {
+            uint8_t rank;               // Hops between us and the collector
+            bool is_joined;             // Rank is valid
+            bool is_parent;             // We beaconed this round and accept children
+            bool was_restore_tried;     // Checkpoint was looked at since boot
+            bool is_restored;           // Joined this round from a checkpoint
+            uint32_t epoch;             // Round we are in, numbered by the collector
+            uint32_t last_epoch;        // Round we finished before, its late frames are dropped
+            uint32_t overheard_beacons; // Beacons from nodes at our rank or closer since we joined
+            Id parent_id;
+            uint32_t data_phase_at; // Clock time at which the staggered data phase starts
+            uint32_t round;         // Rounds finished since boot, for the stream periods
+            Reliability reliability; // Delivery class of our own data
+            uint8_t parent_credits;
+            bool burst_toggle; // BurstToggle of our last burst
+            RateControl rate_control;
+            uint16_t reserved_ms; // Overheard a CTS for someone else, the channel is theirs this long
+            uint32_t reserved_at; // Clock time we heard it
+            Candidate candidates[is_opportunistic ? Config::forwarding_candidates : 1]; // Closest first
+            uint32_t candidate_count;
+            bool is_backed_up; // A candidate, not the parent, acked our last frame
+            Id listed_by;      // Last transmitter that listed us as a candidate
+            uint16_t listed_checksum; // Of its frame, so we notice when it has to repeat it
+            uint8_t backup_frame[is_opportunistic ? max_packet_size : 1]; // Frame we may take over, kept while we wait
+            Child children[max_children];
+            uint32_t child_count;
+            uint32_t grant_cursor; // Child that received the last out of band grant
+            ForwardQueue queue;
+        };
         Packet *data_packet = []()
         {
-            static uint8_t buffer[header_size + data_length];
+            static uint8_t buffer[data_header_size + data_length + candidates_size];
             auto packet = reinterpret_cast<Packet *>(buffer);
             packet->msg_type = MsgType::Data;
             packet->transmitter_id = id;
+            reinterpret_cast<DataInfo *>(packet->data)->source_id = id;
             return packet;
         }();
+        State *state = []()
+        {
+            static State state;
+            return &state;
+        }();
+        Checkpoint *checkpoint = []()
+        {
+            static Checkpoint checkpoint;
+            return &checkpoint;
+        }();
         auto run_as_sensor() const -> void
         {
-            const auto parent_id = find_parent();
-            const auto child_count = count_children();
-            proxy_children(parent_id, child_count);
-            send_own_data(parent_id);
-            send_end_of_data(parent_id);
+            state->last_epoch = state->epoch;
+            state->epoch = unknown_epoch; // Learnt from the beacon of our parent for this round
+            state->candidate_count = 0;   // Only this round's beacons tell who is closer
+            const auto parent_id = restore_or_find_parent();
+            if constexpr (Config::pipelined)
+            {
+                // Our reading goes up while the subtree below us is still forming
+                send_own_data(parent_id, DataFlags::LastData);
+                reset_children();
+                restore_children();
+                const auto is_beaconing = should_beacon();
+                state->is_parent = is_beaconing || await_solicitation();
+                if (is_beaconing)
+                    transmit_i_am_parent();
+                if (!serve_children(parent_id, state->is_parent))
+                    send_end_of_data(parent_id);
+            }
+            else if constexpr (Config::staggered)
+            {
+                count_children();
+                run_staggered(parent_id);
+            }
+            else
+            {
+                count_children();
+                serve_children(parent_id, false);
+                send_own_data(parent_id, DataFlags::LastData | DataFlags::SubtreeComplete);
+            }
+            state->round++;
         };
         auto run_as_collector() const -> void
         {
-            auto child_count = count_children();
-            while (child_count > 0)
+            // Every frame of the round carries this number, starting with our first beacon
+            state->epoch = state->epoch + 1 == unknown_epoch ? state->epoch + 2 : state->epoch + 1;
+            if constexpr (Config::pipelined)
             {
-                const auto [packet, length] = receive_packet(5000);
-                if (length == 0)
-                    return;
-                if (packet->receiver_id != id)
+                reset_children();
+                state->is_parent = true;
+                transmit_i_am_parent();
+                serve_children(broadcast, true);
+            }
+            else if constexpr (Config::staggered)
+            {
+                state->data_phase_at = Config::clock() + Config::formation_ms;
+                count_children();
+                run_staggered(broadcast);
+            }
+            else
+            {
+                count_children();
+                serve_children(broadcast, false);
+            }
+        }
+        // The data phase repeats a cycle of max_depth + 1 slots. The deepest
+        // nodes receive in the first slot and every node transmits in the slot
+        // its parent receives in, so readings ripple from the leaves to the
+        // collector. Relays only hold a few packets, so the cycle repeats until
+        // the subtree is done. Outside its slots the node only sleeps.
+        auto run_staggered(Id parent_id) const -> void
+        {
+            const auto depth = state->rank < Config::max_depth ? state->rank : Config::max_depth;
+            const auto cycle_ms = (Config::max_depth + 1) * Config::slot_ms;
+            auto receive_at = state->data_phase_at + (Config::max_depth - depth) * Config::slot_ms;
+            auto is_own_data_sent = false;
+            auto stalled_slots = 0u;
+            while (true)
+            {
+                if (state->child_count > 0 && !are_children_done())
+                {
+                    for (uint32_t i = 0; i < state->child_count; i++)
+                        state->children[i].is_heard = false;
+                    // Listen a little early for children whose clocks run ahead of ours
+                    sleep_until(receive_at - slot_guard_ms);
+                    receive_until(receive_at);
+                    resend_pending_grants(); // Granted while the children were asleep
+                    grant_freed_credits();
+                    receive_until(receive_at + Config::slot_ms);
+                    count_missed_slots();
+                }
+                const auto is_subtree_done = are_children_done();
+                if constexpr (is_collector)
+                {
+                    if (is_subtree_done)
+                        return;
+                }
+                else
+                {
+                    // The parent listens early, so waking a little early does not hurt
+                    // and catches its grant when its clock runs ahead of ours
+                    const auto transmit_at = receive_at + Config::slot_ms;
+                    sleep_until(transmit_at - slot_guard_ms);
+                    if (transmit_until(parent_id, transmit_at + Config::slot_ms, is_subtree_done, is_own_data_sent, stalled_slots))
+                        return;
+                }
+                receive_at += cycle_ms;
+            }
+        }
+        // Our receive slot, cut short once every child has reported completion
+        auto receive_until(uint32_t deadline) const -> void
+        {
+            while (is_before(deadline) && !are_children_done())
+            {
+                const auto [packet, length] = receive_packet(time_until(deadline));
+                if (length == 0 || packet->receiver_id != id)
                     continue;
-                if (packet->msg_type == MsgType::EndOfData)
+                if (packet->msg_type == MsgType::Credit)
+                    state->parent_credits = credits_of({packet, length}); // Parent's slot starts as ours ends
+                const auto child = find_child(packet->transmitter_id);
+                if (child == nullptr)
+                    continue;
+                child->is_heard = true;
+                child->missed_slots = 0; // Back in touch, wait for it again
+                receive_from_child({packet, length});
+            }
+        }
+        // A child that held credit through a whole slot and sent nothing is out
+        // of reach, maybe for good. After max_missed_slots of those in a row
+        // we stop waiting for it, its siblings are still served as usual.
+        auto count_missed_slots() const -> void
+        {
+            for (uint32_t i = 0; i < state->child_count; i++)
+            {
+                auto &child = state->children[i];
+                if (child.is_heard || child.is_done || child.credits == 0 || is_abandoned(child))
+                    continue;
+                child.missed_slots++;
+                if (!is_abandoned(child))
+                    continue;
+                child.credits = 0; // Its slots go to the siblings
+                child.grant_pending = false;
+            }
+        }
+        auto is_abandoned(const Child &child) const -> bool
+        {
+            return child.missed_slots > Config::max_missed_slots;
+        }
+        // Our parent's receive slot. Whatever does not fit waits for the next
+        // cycle. Returns true once the round is over for us, because subtree
+        // completion was reported or the parent is out of reach.
+        auto transmit_until(Id parent_id, uint32_t deadline, bool is_subtree_done, bool &is_own_data_sent,
+                            uint32_t &stalled_slots) const -> bool
+        {
+            if (is_own_data_sent && state->queue.count == 0 && !is_subtree_done)
+                return false; // Nothing to send yet, so no credit to wait for
+            // Without credit the parent's slot is over before it gets to us, so
+            // unlike the other modes we retry next cycle instead of sending
+            // anyway. A parent that gave up on us or is gone never grants any
+            // though, so after max_missed_slots slots without getting anything
+            // through we send regardless, and end the round if that fails too.
+            const auto is_last_chance = stalled_slots > Config::max_missed_slots;
+            if (is_last_chance && state->parent_credits == 0)
+                state->parent_credits = 1;
+            stalled_slots++;
+            wait_for_credit(parent_id, time_until(deadline));
+            if (state->parent_credits == 0 || !is_before(deadline))
+                return false;
+            if (!is_own_data_sent)
+            {
+                const auto is_last = is_subtree_done && state->queue.count == 0;
+                const auto flags = DataFlags::LastData | (is_last ? DataFlags::SubtreeComplete : 0);
+                if (!send_own_data(parent_id, flags))
+                    return is_last_chance;
+                stalled_slots = 0;
+                is_own_data_sent = true;
+                if (is_last)
+                    return true;
+            }
+            while (state->queue.count > 0 && is_before(deadline))
+            {
+                if (state->parent_credits == 0)
                 {
-                    child_count--;
-                    send_ack(packet->transmitter_id);
+                    wait_for_credit(parent_id, time_until(deadline));
+                    if (state->parent_credits == 0 || !is_before(deadline))
+                        return false;
                 }
-
-                if (packet->msg_type == MsgType::Data)
+                const auto is_last = is_subtree_done && state->queue.count == 1;
+                if (!forward_one(parent_id, is_last, true))
+                    return is_last_chance; // Otherwise the parent's slot is probably over
+                stalled_slots = 0;
+                if (is_last)
+                    return true;
+            }
+            if (!is_subtree_done || state->queue.count > 0)
+                return false;
+            send_end_of_data(parent_id);
+            return true;
+        }
+        auto sleep_until(uint32_t time) const -> void
+        {
+            if (is_before(time))
+                sleep(time_until(time) * 1000);
+        }
+        auto is_before(uint32_t time) const -> bool
+        {
+            return static_cast<int32_t>(Config::clock() - time) < 0;
+        }
+        auto time_until(uint32_t time) const -> uint32_t
+        {
+            const auto left = static_cast<int32_t>(time - Config::clock());
+            return left > 0 ? static_cast<uint32_t>(left) : 1;
+        }
+        // After a reset try to rejoin the parent from the checkpoint with a single
+        // IAmChild exchange, and fall back to waiting for beacons if it fails
+        auto restore_or_find_parent() const -> Id
+        {
+            state->is_restored = false;
+            // The staggered schedule is learnt from the parent's beacon, so it cannot skip it
+            if constexpr (has_checkpoint && !Config::staggered)
+            {
+                if (!state->was_restore_tried)
                 {
-                    collector_callback(packet->transmitter_id, {reinterpret_cast<uint8_t *>(packet),
-                                                                length});
-                    send_ack(packet->transmitter_id);
+                    state->was_restore_tried = true;
+                    if (load_checkpoint() && join(checkpoint->parent_id, checkpoint->rank))
+                    {
+                        state->is_restored = true;
+                        return checkpoint->parent_id;
+                    }
                 }
             }
+            return find_parent();
         }
+        // Loops rather than recursing, so a long outage cannot grow the stack
         auto find_parent() const -> Id
         {
-            auto packet_wrapper = receive_packet(0);
-            auto [packet, length] = packet_wrapper;
-            if (packet->msg_type != MsgType::IAmParent)
-                return find_parent(); // try again
-            const auto parent_id = packet->transmitter_id;
+            state->is_joined = false;
+            while (true)
+            {
+                auto packet_wrapper = wait_for_parent();
+                auto [packet, length] = packet_wrapper;
+                if (packet->msg_type != MsgType::IAmParent)
+                    continue; // try again
+                if (credits_of({packet, length}) == 0)
+                    continue; // Parent has no room for us, wait for another one
+                const auto parent_id = packet->transmitter_id;
+                const auto rank = rank_of({packet, length}) + 1;
+                state->epoch = packet->epoch;
+                if constexpr (Config::staggered)
+                    state->data_phase_at = Config::clock() + data_phase_ms_of({packet, length});
+                if (join(parent_id, rank))
+                    return parent_id;
+                state->epoch = unknown_epoch; // That round may be over, do not let it filter out the next beacons
+            }
+        }
+        auto join(Id parent_id, uint8_t rank) const -> Result
+        {
             const Packet i_am_child = {
                 MsgType::IAmChild,
                 id,
                 parent_id,
+                state->epoch,
             };
             const ConstPacketWrapper i_am_child_wrapper = {
                 &i_am_child,
                 header_size,
             };
-            if (deliver(i_am_child_wrapper))
-                return parent_id;
-            return find_parent(); // try again
+            if (!deliver(i_am_child_wrapper))
+                return Result::Fail;
+            state->parent_id = parent_id;
+            state->rank = rank;
+            state->is_joined = true;
+            state->overheard_beacons = 0;
+            save_checkpoint();
+            return Result::Ok;
+        }
+        // Children from before the reset are still trying to reach us. They
+        // count only once they announce themselves again during formation,
+        // so one that died or moved does not hold up every round.
+        auto restore_children() const -> void
+        {
+            if (!state->is_restored)
+                return;
+            for (uint32_t i = 0; i < checkpoint->child_count; i++)
+            {
+                const auto child = add_child(checkpoint->children[i]);
+                if (child != nullptr)
+                    child->is_provisional = true;
+            }
+        }
+        auto drop_provisional_children() const -> void
+        {
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < state->child_count; i++)
+                if (!state->children[i].is_provisional)
+                    state->children[kept++] = state->children[i];
+            if (kept == state->child_count)
+                return;
+            // Nothing was queued by the dropped ones, only the indices moved
+            state->child_count = kept;
+            state->queue.current = 0;
+            state->grant_cursor = 0;
+        }
+        // Storage like flash wears out, so only a changed parent, rank or child
+        // set is written. The checkpoint in RAM mirrors storage once it was
+        // loaded or saved.
+        auto save_checkpoint() const -> void
+        {
+            if constexpr (has_checkpoint)
+            {
+                Checkpoint current = {};
+                current.magic = checkpoint_magic;
+                current.node_id = id;
+                current.parent_id = state->parent_id;
+                current.rank = state->rank;
+                for (uint32_t i = 0; i < state->child_count; i++)
+                    if (!state->children[i].is_backup)
+                        current.children[current.child_count++] = state->children[i].child_id;
+                if (is_checkpoint_stored(current))
+                    return;
+                *checkpoint = current;
+                checkpoint->checksum = checkpoint_checksum();
+                Config::save_state({reinterpret_cast<const uint8_t *>(checkpoint), sizeof(Checkpoint)});
+            }
+        }
+        // Children may have joined in a different order, that is the same set
+        auto is_checkpoint_stored(const Checkpoint &current) const -> bool
+        {
+            const auto &stored = *checkpoint;
+            if (stored.magic != checkpoint_magic || stored.parent_id != current.parent_id ||
+                stored.rank != current.rank || stored.child_count != current.child_count)
+                return false;
+            for (uint32_t i = 0; i < current.child_count; i++)
+            {
+                auto is_found = false;
+                for (uint32_t j = 0; j < stored.child_count && !is_found; j++)
+                    is_found = stored.children[j] == current.children[i];
+                if (!is_found)
+                    return false;
+            }
+            return true;
+        }
+        auto load_checkpoint() const -> bool
+        {
+            if constexpr (has_checkpoint)
+            {
+                const auto length = Config::load_state({reinterpret_cast<uint8_t *>(checkpoint), sizeof(Checkpoint)});
+                const auto is_valid = length == sizeof(Checkpoint) &&
+                                      checkpoint->magic == checkpoint_magic &&
+                                      checkpoint->node_id == id &&
+                                      checkpoint->child_count <= max_children &&
+                                      checkpoint->checksum == checkpoint_checksum();
+                if (!is_valid)
+                    *checkpoint = {}; // Nothing usable is stored, the next save must write
+                return is_valid;
+            }
+            return false;
+        }
+        // Fletcher-16 over everything but the checksum itself
+        auto checkpoint_checksum() const -> uint16_t
+        {
+            const auto stored = checkpoint->checksum;
+            checkpoint->checksum = 0;
+            const auto sum = fletcher16(reinterpret_cast<const uint8_t *>(checkpoint), sizeof(Checkpoint));
+            checkpoint->checksum = stored;
+            return sum;
+        }
+        // Recognises a data frame on every hop: headers and flags change on
+        // the way, the source and the payload do not
+        auto data_checksum(ConstPacketWrapper packet_wrapper) const -> uint16_t
+        {
+            const auto info = reinterpret_cast<const DataInfo *>(packet_wrapper.packet->data);
+            const auto sum = fletcher16(reinterpret_cast<const uint8_t *>(&info->source_id), sizeof(Id));
+            return fletcher16(packet_wrapper.packet->data + sizeof(DataInfo), payload_length_of(packet_wrapper), sum);
+        }
+        // Continues from an earlier sum, so separate pieces can be summed as one
+        auto fletcher16(const uint8_t *bytes, uint32_t length, uint16_t sum = 0) const -> uint16_t
+        {
+            uint16_t sum1 = sum & 0xff;
+            uint16_t sum2 = sum >> 8;
+            for (uint32_t i = 0; i < length; i++)
+            {
+                sum1 = (sum1 + bytes[i]) % 255;
+                sum2 = (sum2 + sum1) % 255;
+            }
+            return static_cast<uint16_t>((sum2 << 8) | sum1);
+        }
+        // Returns the next beacon heard while unjoined. Unless disabled we ask the
+        // neighbours for a parent whenever solicit_interval_ms passes without
+        // one, instead of waiting for the next round's beacons. The first
+        // interval gives this round's beacons a chance, and traffic that is
+        // not a beacon does not postpone the next request.
+        auto wait_for_parent() const -> PacketWrapper
+        {
+            constexpr auto is_soliciting = Config::solicit_interval_ms > 0;
+            while (true)
+            {
+                auto deadline = start_deadline(Config::solicit_interval_ms);
+                while (!is_soliciting || time_left(deadline) > 0)
+                {
+                    // Without soliciting, wait for a beacon however long it takes
+                    const auto packet_wrapper = is_soliciting ? receive_before(deadline, 50) : receive_packet(0);
+                    if (packet_wrapper.length > 0 && packet_wrapper.packet->msg_type == MsgType::IAmParent)
+                        return packet_wrapper;
+                }
+                solicit_parent();
+            }
         }
         auto count_children() const -> uint32_t
         {
-            transmit_i_am_parent();
-            auto child_count = 0;
+            reset_children();
+            restore_children();
+            const auto is_beaconing = should_beacon();
+            if (!is_beaconing && !await_solicitation())
+                return state->child_count; // Neighbours are covered already, nobody new will pick us
+            state->is_parent = true;
+            if (is_beaconing)
+                transmit_i_am_parent();
             while (true)
             {
                 const auto [packet, length] = receive_packet(100);
                 if (length == 0)
-                    return child_count;
+                {
+                    drop_provisional_children();
+                    save_checkpoint();
+                    return state->child_count;
+                }
+                if (packet->receiver_id == id && packet->msg_type == MsgType::Credit)
+                    state->parent_credits = credits_of({packet, length});
+                if (packet->msg_type == MsgType::SolicitParent)
+                    answer_solicitation(packet->transmitter_id);
                 if (packet->receiver_id == id && packet->msg_type == MsgType::IAmChild)
                 {
-                    send_ack(packet->transmitter_id);
-                    child_count++;
+                    // No credit yet, we are not listening for data until counting is over
+                    const auto child = add_child(packet->transmitter_id);
+                    if (child == nullptr)
+                        continue;
+                    child->is_provisional = false;
+                    acknowledge(child->child_id, 0, 0);
                 }
             }
         }
-        auto proxy_children(Id parent_id,
-                            uint32_t child_count) const -> void
+        // Receive data from children and pass it on until the whole subtree is
+        // done. While admitting, children may still join and we only stop once
+        // nobody asked to join for a whole counting window. Returns true if
+        // subtree completion was already reported to the parent.
+        auto serve_children(Id parent_id, bool is_admitting) const -> bool
         {
-            if (child_count == 0)
-                return;
-            auto [packet, length] = receive_packet(5000);
-            if (length == 0)
-                return;
-            if (packet->receiver_id != id)
-                return proxy_children(parent_id, child_count); // Try again
-            if (packet->msg_type != MsgType::Data && packet->msg_type != MsgType::EndOfData)
-                return proxy_children(parent_id, child_count); // Try again
-            send_ack(packet->transmitter_id);
-            if (packet->msg_type == MsgType::EndOfData)
-                return proxy_children(parent_id, child_count - 1); // One child done
-            packet->receiver_id = parent_id;
-            deliver({packet,
-                     length});
+            if (!is_admitting)
+                drop_provisional_children(); // Formation is over
+            grant_freed_credits();
+            if constexpr (Config::receiver_initiated)
+                transmit_probe();
+            auto silent_ms = 0;
+            auto admission_ms = 0;
+            auto beacon_ms = 0u;
+            auto probe_ms = 0u;
+            while (true)
+            {
+                if (is_admitting && admission_ms >= 100)
+                {
+                    is_admitting = false;
+                    drop_provisional_children();
+                    save_checkpoint(); // Child set is final now
+                }
+                const auto is_subtree_done = !is_admitting && are_children_done();
+                if (state->queue.count > 0 && state->parent_credits > 0)
+                {
+                    // With our own data already sent, the last forwarded packet can carry completion
+                    const auto is_last = Config::pipelined && is_subtree_done && state->queue.count == 1;
+                    if (!is_last && burst_length() > 1)
+                        forward_burst(parent_id);
+                    else
+                        forward_one(parent_id, is_last);
+                    if (is_last)
+                        return true;
+                    continue;
+                }
+                if (is_subtree_done && state->queue.count == 0)
+                    return false;
+                if (silent_ms >= 5000)
+                    return false;
+                const auto [packet, length] = receive_packet(50);
+                if (length == 0)
+                {
+                    silent_ms += 50;
+                    admission_ms += 50;
+                    beacon_ms += 50;
+                    probe_ms += 50;
+                    if (silent_ms % grant_resend_ms == 0)
+                        resend_pending_grants();
+                    if (Config::receiver_initiated && probe_ms >= Config::probe_period_ms)
+                    {
+                        probe_ms = 0;
+                        transmit_probe();
+                    }
+                    if (state->is_parent && beacon_ms >= Config::beacon_period_ms)
+                    {
+                        beacon_ms = 0; // Low rate reminder for nodes that just woke up
+                        transmit_i_am_parent();
+                    }
+                    continue;
+                }
+                if (packet->msg_type == MsgType::Probe)
+                    continue; // Periodic, a neighbour's probes must not keep us waiting for silence
+                silent_ms = 0;
+                if (packet->msg_type == MsgType::SolicitParent)
+                {
+                    answer_solicitation(packet->transmitter_id);
+                    continue;
+                }
+                if (packet->receiver_id != id)
+                {
+                    if constexpr (is_opportunistic)
+                        back_up({packet, length});
+                    continue;
+                }
+                if (packet->transmitter_id == parent_id && packet->msg_type == MsgType::Credit)
+                {
+                    state->parent_credits = credits_of({packet, length});
+                    continue;
+                }
+                if (receive_from_child({packet, length}))
+                    admission_ms = 0;
+            }
         }
-        auto deliver(ConstPacketWrapper packet_wrapper) const -> Result
+        // Handle a join request or data from a child. Returns true for joins.
+        auto receive_from_child(ConstPacketWrapper packet_wrapper) const -> bool
         {
-            for (auto attempts = 0; attempts < 10; attempts++)
+            const auto packet = packet_wrapper.packet;
+            if (packet->msg_type == MsgType::IAmChild)
             {
-                sleep(sleep_time);
-                while (is_channel_busy())
-                    sleep(sleep_time);
-                transmit_packet(packet_wrapper);
-                if (get_ack(packet_wrapper.packet->receiver_id))
-                    return Result::Ok;
+                // Late joiners are welcome, we are already listening for their data
+                const auto child = add_child(packet->transmitter_id);
+                if (child == nullptr)
+                    return false;
+                child->is_provisional = false;
+                if (child->is_backup)
+                {
+                    // We forwarded for it before, now it is our child for real
+                    child->is_backup = false;
+                    child->is_done = false;
+                }
+                top_up_credits(child);
+                acknowledge(child->child_id, child->credits, 0);
+                return true;
             }
-            return Result::Fail;
-        };
-        auto get_ack(Id transmitter_id) const -> Result
-        {
-            for (auto attempts = 0; attempts < 3; attempts++)
+            if (packet->msg_type == MsgType::Rts)
             {
-                const auto [packet, length] = receive_packet(10);
-                if (length == 0)
-                    continue;
-                const auto is_receiver_ok = packet->receiver_id == id;
-                const auto is_transmitter_ok = packet->transmitter_id == transmitter_id;
-                const auto is_msg_type_ok = packet->msg_type == MsgType::Ack;
-                const auto is_everything_ok = is_receiver_ok && is_transmitter_ok && is_msg_type_ok;
-                if (is_everything_ok)
-                    return Result::Ok;
+                if (packet_wrapper.length >= reservation_packet_size)
+                    send_cts(packet->transmitter_id, reinterpret_cast<const ReservationPacket *>(packet)->reserve_ms);
+                return false;
             }
-            return Result::Fail;
-        };
-        auto transmit_i_am_parent() const -> void
-        {
-            const Header packet = {
-                MsgType::IAmParent,
-                id,
-                broadcast,
-            };
-            sleep(sleep_time);
-            while (is_channel_busy())
-                sleep(sleep_time);
-            transmit(packet);
+            if (packet->msg_type != MsgType::Data && packet->msg_type != MsgType::EndOfData)
+                return false;
+            auto child = find_child(packet->transmitter_id);
+            if (child == nullptr)
+                child = add_child(packet->transmitter_id); // Joined after we stopped counting
+            if (child == nullptr)
+                return false;
+            child->is_provisional = false;
+            const auto is_final = completes_subtree(packet_wrapper);
+            if (is_final && child->is_done)
+            {
+                acknowledge(child->child_id, 0, 0); // Our ack got lost and the child repeats its last packet
+                return false;
+            }
+            if (is_burst_frame(packet_wrapper))
+                return receive_burst_frame(child, packet_wrapper);
+            auto believed_credits = child->credits; // What the child counts on once it sees the ack
+            if (packet->msg_type == MsgType::Data)
+            {
+                // The child missed our forward and repeats the frame, it is ours already
+                if (child->is_implicitly_acked && child->implicit_checksum == data_checksum(packet_wrapper))
+                {
+                    acknowledge(child->child_id, child->credits, believed_credits);
+                    return false;
+                }
+                // With hardware acks the child thinks this got through even when rejected,
+                // but it only happens when the child ran out of patience waiting for credit
+                if (!accept_data(child, packet_wrapper))
+                    return false;
+                child->grant_pending = false;
+                if (child->credits > 0 && child->credits != unlimited_credits)
+                    child->credits--;
+                believed_credits = child->credits;
+                // No ack carries a top-up to a child that overhears our forward,
+                // it gets more once its credit runs out and a slot frees up
+                if (!is_acked_by_forward(packet_wrapper, is_collector))
+                    top_up_credits(child);
+            }
+            if (is_final)
+            {
+                child->is_done = true;
+                child->credits = 0;
+                believed_credits = 0;
+            }
+            child->is_implicitly_acked = is_acked_by_forward(packet_wrapper, is_collector);
+            if (child->is_implicitly_acked)
+                child->implicit_checksum = data_checksum(packet_wrapper);
+            if (is_best_effort(packet_wrapper) || child->is_implicitly_acked)
+                notify_credit(child->child_id, child->credits, believed_credits);
+            else
+                acknowledge(child->child_id, child->credits, believed_credits);
+            if constexpr (Config::receiver_initiated && Transport::hardware_ack)
+                transmit_probe(); // Siblings cannot overhear a hardware ack, tell them we still listen
+            return false;
         }
-        auto send_own_data(uint32_t parent_id) const -> void
+        // Frames of a burst are confirmed together once the last one arrives.
+        // Repeated frames are recognised by their position and not accepted twice.
+        auto receive_burst_frame(Child *child, ConstPacketWrapper packet_wrapper) const -> bool
         {
-            data_packet->receiver_id = parent_id;
-            deliver({data_packet,
-                     header_size + data_length});
+            const auto flags = data_flags_of(packet_wrapper);
+            const auto toggle = (flags & DataFlags::BurstToggle) != 0;
+            if (toggle != child->burst_toggle)
+            {
+                child->burst_toggle = toggle;
+                child->burst_received = 0;
+            }
+            const auto position_bit = static_cast<uint8_t>(1 << (flags >> burst_position_shift));
+            if (!(child->burst_received & position_bit) && accept_data(child, packet_wrapper))
+            {
+                child->burst_received |= position_bit;
+                child->grant_pending = false;
+                if (child->credits > 0 && child->credits != unlimited_credits)
+                    child->credits--;
+                top_up_credits(child);
+            }
+            if (!(flags & DataFlags::MoreInBurst))
+                send_block_ack(child->child_id, child->credits, child->burst_received);
+            return false;
         }
-        auto send_end_of_data(uint32_t parent_id) const -> void
+        // Hand a data packet to the application or queue it for the parent
+        auto accept_data(Child *child, ConstPacketWrapper packet_wrapper) const -> bool
         {
-            static Packet packet = {
+            const auto [packet, length] = packet_wrapper;
+            if (length < data_header_size || length > max_packet_size)
+                return false;
+            if constexpr (is_collector)
+            {
+                const auto info = reinterpret_cast<const DataInfo *>(packet->data);
+                const ConstBytes payload = {packet->data + sizeof(DataInfo), payload_length_of(packet_wrapper)};
+                if constexpr (Config::stream_callback != nullptr)
+                    unpack_streams(info->source_id, payload);
+                else
+                    collector_callback(info->source_id, payload);
+                return true;
+            }
+            if (state->queue.count == relay_queue_length)
+                return false; // Child ignored our credit, let it retry later
+            enqueue(child, packet_wrapper);
+            return true;
+        }
+        // Take over a frame its transmitter's parent seems to have missed. Only
+        // repeated frames qualify, a first attempt mostly gets through and a
+        // candidate that misses the parent's ack would forward it twice.
+        // Candidates wait in the order the frame lists them, so the first one
+        // that heard the frame answers and its ack silences the others. The
+        // frame may take a slot promised to a child, which then retries.
+        auto back_up(ConstPacketWrapper packet_wrapper) const -> void
+        {
+            const auto position = candidate_position(packet_wrapper);
+            if (position == 0)
+                return;
+            const auto transmitter_id = packet_wrapper.packet->transmitter_id;
+            const auto checksum = data_checksum(packet_wrapper);
+            const auto is_repeat = state->listed_by == transmitter_id && state->listed_checksum == checksum;
+            state->listed_by = transmitter_id;
+            state->listed_checksum = checksum;
+            if (!is_repeat || state->queue.count == relay_queue_length || packet_wrapper.length > max_packet_size)
+                return;
+            const auto length = packet_wrapper.length;
+            const auto bytes = reinterpret_cast<const uint8_t *>(packet_wrapper.packet);
+            for (uint32_t i = 0; i < length; i++)
+                state->backup_frame[i] = bytes[i]; // The radio reuses its buffer while we wait
+            auto overheard = 0;
+            for (auto waited_ms = 0u; waited_ms < position * Config::candidate_delay_ms && overheard < 32;)
+            {
+                const auto [packet, heard_length] = receive_packet(Config::candidate_delay_ms);
+                if (heard_length == 0)
+                {
+                    waited_ms += Config::candidate_delay_ms;
+                    continue;
+                }
+                overheard++;
+                if (packet->msg_type == MsgType::Ack && packet->receiver_id == transmitter_id)
+                    return; // The parent or a better candidate has it
+                if (packet->receiver_id == id && find_child(packet->transmitter_id) != nullptr)
+                    receive_from_child({packet, heard_length});
+            }
+            // The collector hands data straight to the callback, relays queue it under the transmitter
+            Child *child = nullptr;
+            if constexpr (!is_collector)
+            {
+                child = add_backup_child(transmitter_id);
+                if (child == nullptr)
+                    return;
+            }
+            if (!accept_data(child, {reinterpret_cast<const Packet *>(state->backup_frame), length}))
+                return;
+            if (child != nullptr)
+                child->subtree_size = 0; // Already counted by its own parent
+            send_ack(transmitter_id, 0);
+        }
+        // nullptr when the transmitter is a real child of ours or there is no room for it
+        auto add_backup_child(Id transmitter_id) const -> Child *
+        {
+            auto child = find_child(transmitter_id);
+            if (child != nullptr)
+                return child->is_backup ? child : nullptr;
+            child = add_child(transmitter_id);
+            if (child == nullptr)
+                return nullptr;
+            child->is_backup = true;
+            child->is_done = true; // Its round ends with its parent, not with us
+            return child;
+        }
+        // Where the frame lists us among its candidate forwarders, from 1, or 0 when it does not
+        auto candidate_position(ConstPacketWrapper packet_wrapper) const -> uint32_t
+        {
+            if (!(data_flags_of(packet_wrapper) & DataFlags::HasCandidates))
+                return 0;
+            const auto bytes = reinterpret_cast<const uint8_t *>(packet_wrapper.packet);
+            const auto count = bytes[packet_wrapper.length - 1];
+            if (count * sizeof(Id) + 1 > packet_wrapper.length - data_header_size)
+                return 0; // Corrupt list
+            const auto list = bytes + packet_wrapper.length - 1 - count * sizeof(Id);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                Id candidate_id = 0;
+                for (uint32_t j = 0; j < sizeof(Id); j++)
+                    reinterpret_cast<uint8_t *>(&candidate_id)[j] = list[i * sizeof(Id) + j];
+                if (candidate_id == id)
+                    return i + 1;
+            }
+            return 0;
+        }
+        auto are_children_done() const -> bool
+        {
+            for (uint32_t i = 0; i < state->child_count; i++)
+                if (!state->children[i].is_done && !is_abandoned(state->children[i]))
+                    return false;
+            return true;
+        }
+        auto is_expired(const Slot &slot) const -> bool
+        {
+            if constexpr (Config::clock == nullptr)
+                return false;
+            else
+            {
+                const auto info = reinterpret_cast<const DataInfo *>(slot.buffer + header_size);
+                const auto waited_ms = Config::clock() - slot.queued_at;
+                return (info->flags & DataFlags::LimitedRetry) && waited_ms > Config::limited_retry_deadline_ms;
+            }
+        }
+        // With is_kept_on_failure an undelivered packet stays queued for another try
+        auto forward_one(Id parent_id, bool is_last, bool is_kept_on_failure = false) const -> Result
+        {
+            auto &queue = state->queue;
+            const auto child = next_to_forward();
+            const auto index = child->head;
+            auto &slot = queue.slots[index];
+            auto packet = reinterpret_cast<Packet *>(slot.buffer);
+            packet->transmitter_id = id;
+            packet->receiver_id = parent_id;
+            packet->epoch = state->epoch; // Known by now even if the child joined without it
+            auto info = reinterpret_cast<DataInfo *>(packet->data);
+            info->subtree_size = subtree_size();
+            info->flags &= ~(DataFlags::SubtreeComplete | DataFlags::HasCandidates | burst_flags); // Only meant for us, not for our parent
+            // Expendable packets are dropped when they run out of attempts or time,
+            // so completion cannot ride on them
+            const auto is_expendable = (info->flags & (DataFlags::BestEffort | DataFlags::LimitedRetry)) != 0;
+            const auto is_carrying_completion = is_last && !is_expendable;
+            if (is_carrying_completion)
+                info->flags |= DataFlags::SubtreeComplete;
+            const auto length = attach_candidates(packet, slot.length);
+            auto result = !is_carrying_completion && is_expired(slot) ? Result::Fail : deliver({packet, length});
+            if (is_last && !is_carrying_completion)
+                result = send_end_of_data(parent_id);
+            else if (result && is_last && state->is_backed_up)
+                send_end_of_data(parent_id); // A candidate took our last frame, the parent still waits for it
+            if (!result && is_kept_on_failure && !is_expendable)
+                return result;
+            child->deficit -= slot.length;
+            child->head = slot.next;
+            child->queued--;
+            slot.next = queue.free_head;
+            queue.free_head = index;
+            queue.count--;
+            grant_freed_credits();
+            return result;
+        }
+        // Frames the next child in line could send as one burst, 1 when bursts
+        // do not apply. Only reliable packets within the child's deficit and
+        // our credit go into a burst.
+        auto burst_length() const -> uint32_t
+        {
+            if constexpr (Transport::transmit_batch == nullptr || Config::receiver_initiated)
+                return 1;
+            auto &queue = state->queue;
+            if (queue.count < 2)
+                return 1;
+            const auto child = next_to_forward();
+            auto limit = Config::max_burst < child->queued ? Config::max_burst : child->queued;
+            if (state->parent_credits != unlimited_credits && state->parent_credits < limit)
+                limit = state->parent_credits;
+            auto length = 0u, bytes = 0u;
+            for (auto index = child->head; length < limit; index = queue.slots[index].next)
+            {
+                const auto &slot = queue.slots[index];
+                const auto info = reinterpret_cast<const DataInfo *>(slot.buffer + header_size);
+                bytes += slot.length;
+                if (bytes > child->deficit || (info->flags & (DataFlags::BestEffort | DataFlags::LimitedRetry)))
+                    break;
+                length++;
+            }
+            return length > 0 ? length : 1;
+        }
+        // Send the head packets of the next child in line as one burst, then
+        // repeat only what the block ack does not confirm
+        auto forward_burst(Id parent_id) const -> Result
+        {
+            auto &queue = state->queue;
+            const auto length = burst_length();
+            const auto child = next_to_forward();
+            Bytes frames[Config::max_burst];
+            uint32_t indices[Config::max_burst];
+            state->burst_toggle = !state->burst_toggle;
+            auto index = child->head;
+            for (uint32_t i = 0; i < length; i++, index = queue.slots[index].next)
+            {
+                auto &slot = queue.slots[index];
+                auto packet = reinterpret_cast<Packet *>(slot.buffer);
+                packet->transmitter_id = id;
+                packet->receiver_id = parent_id;
+                packet->epoch = state->epoch;
+                auto info = reinterpret_cast<DataInfo *>(packet->data);
+                info->subtree_size = subtree_size();
+                info->flags &= ~(DataFlags::SubtreeComplete | DataFlags::HasCandidates | burst_flags);
+                info->flags |= DataFlags::Burst | (i << burst_position_shift);
+                if (state->burst_toggle)
+                    info->flags |= DataFlags::BurstToggle;
+                indices[i] = index;
+            }
+            uint8_t pending = static_cast<uint8_t>((1 << length) - 1);
+            start_delivery(parent_id);
+            for (auto attempts = 0; attempts < 10 && pending != 0; attempts++)
+            {
+                uint32_t count = 0;
+                for (uint32_t i = 0; i < length; i++)
+                {
+                    if (!(pending & (1 << i)))
+                        continue;
+                    auto &slot = queue.slots[indices[i]];
+                    auto info = reinterpret_cast<DataInfo *>(slot.buffer + header_size);
+                    info->flags |= DataFlags::MoreInBurst;
+                    frames[count++] = {slot.buffer, slot.length};
+                }
+                // The last frame asks for the block ack
+                reinterpret_cast<DataInfo *>(frames[count - 1].buf + header_size)->flags &= ~DataFlags::MoreInBurst;
+                honour_reservation();
+                sleep(sleep_time);
+                while (is_channel_busy())
+                    sleep(sleep_time);
+                auto bytes = 0u;
+                for (uint32_t i = 0; i < count; i++)
+                    bytes += frames[i].len;
+                if (!reserve_channel(parent_id, bytes))
+                    continue;
+                const auto rate = select_rate(attempts);
+                Transport::transmit_batch(frames, count);
+                const auto confirmed = pending & get_block_ack(parent_id);
+                use_rate(0);
+                record_rate(rate, bits_set(confirmed), count);
+                pending &= ~confirmed;
+            }
+            for (uint32_t i = 0; i < length; i++)
+            {
+                auto &slot = queue.slots[child->head];
+                const auto next = slot.next;
+                child->deficit -= slot.length;
+                slot.next = queue.free_head;
+                queue.free_head = child->head;
+                child->head = next;
+                child->queued--;
+                queue.count--;
+            }
+            grant_freed_credits();
+            return pending == 0 ? Result::Ok : Result::Fail;
+        }
+        // Deficit round-robin: every visit adds a quantum scaled by the child's
+        // weight, and a child is served while its head packet fits the deficit.
+        // Must only be called with at least one packet queued.
+        auto next_to_forward() const -> Child *
+        {
+            auto &queue = state->queue;
+            while (true)
+            {
+                auto &child = state->children[queue.current];
+                if (child.queued > 0 && queue.slots[child.head].length <= child.deficit)
+                    return &child;
+                if (child.queued == 0)
+                    child.deficit = 0; // Idle children do not bank airtime
+                queue.current = (queue.current + 1) % state->child_count;
+                auto &next = state->children[queue.current];
+                if (next.queued > 0)
+                    next.deficit += max_packet_size * weight_of(next);
+            }
+        }
+        auto enqueue(Child *child, ConstPacketWrapper packet_wrapper) const -> void
+        {
+            auto &queue = state->queue;
+            const auto index = queue.free_head;
+            auto &slot = queue.slots[index];
+            queue.free_head = slot.next;
+            const auto bytes = reinterpret_cast<const uint8_t *>(packet_wrapper.packet);
+            // The candidates were chosen by the child, ours are attached when we forward
+            const auto is_data = packet_wrapper.length >= data_header_size;
+            const auto length = is_data ? data_header_size + payload_length_of(packet_wrapper) : packet_wrapper.length;
+            for (uint32_t i = 0; i < length; i++)
+                slot.buffer[i] = bytes[i];
+            slot.length = length;
+            if (is_data)
+                reinterpret_cast<DataInfo *>(slot.buffer + header_size)->flags &= ~DataFlags::HasCandidates;
+            if constexpr (Config::clock != nullptr)
+                slot.queued_at = Config::clock();
+            slot.next = no_slot;
+            if (child->queued == 0)
+                child->head = index;
+            else
+                queue.slots[child->tail].next = index;
+            child->tail = index;
+            child->queued++;
+            queue.count++;
+            if (packet_wrapper.length >= data_header_size)
+                child->subtree_size = reinterpret_cast<const DataInfo *>(packet_wrapper.packet->data)->subtree_size;
+        }
+        auto reset_children() const -> void
+        {
+            state->is_parent = false;
+            state->child_count = 0;
+            state->grant_cursor = 0;
+            reset_queue();
+        }
+        auto reset_queue() const -> void
+        {
+            auto &queue = state->queue;
+            for (uint32_t i = 0; i < relay_queue_length; i++)
+                queue.slots[i].next = i + 1;
+            queue.free_head = 0;
+            queue.count = 0;
+            queue.current = 0;
+        }
+        auto weight_of(const Child &child) const -> uint32_t
+        {
+            if constexpr (Config::weight_by_subtree)
+                return child.subtree_size > 0 ? child.subtree_size : 1;
+            return 1;
+        }
+        // The final packet of a child, either flagged data or a bare EndOfData
+        auto completes_subtree(ConstPacketWrapper packet_wrapper) const -> bool
+        {
+            const auto packet = packet_wrapper.packet;
+            if (packet->msg_type == MsgType::EndOfData)
+                return true;
+            if (packet->msg_type != MsgType::Data || packet_wrapper.length < data_header_size)
+                return false;
+            const auto info = reinterpret_cast<const DataInfo *>(packet->data);
+            return (info->flags & DataFlags::SubtreeComplete) != 0;
+        }
+        auto subtree_size() const -> uint16_t
+        {
+            uint16_t size = 1;
+            for (uint32_t i = 0; i < state->child_count; i++)
+                size += state->children[i].subtree_size;
+            return size;
+        }
+        // Queue slots that are neither occupied nor promised to any child
+        auto free_credits() const -> uint32_t
+        {
+            if constexpr (is_collector)
+                return unlimited_credits; // Data goes straight to the callback
+            uint32_t promised = state->queue.count;
+            for (uint32_t i = 0; i < state->child_count; i++)
+                promised += state->children[i].credits;
+            return promised < relay_queue_length ? relay_queue_length - promised : 0;
+        }
+        // Each child may hold at most its weighted share of the queue, and no
+        // more than one slot per device in its subtree so early joiners cannot
+        // sit on credit that later siblings need
+        auto top_up_credits(Child *child) const -> void
+        {
+            if constexpr (is_collector)
+            {
+                child->credits = unlimited_credits;
+                return;
+            }
+            uint32_t total_weight = 0;
+            for (uint32_t i = 0; i < state->child_count; i++)
+                total_weight += weight_of(state->children[i]);
+            const auto share = relay_queue_length * weight_of(*child) / total_weight;
+            const auto capped_share = share < child->subtree_size ? share : child->subtree_size;
+            const auto fair_share = capped_share > 0 ? capped_share : 1;
+            const auto free = free_credits();
+            if (child->is_done || child->credits >= fair_share)
+                return;
+            const auto missing = fair_share - child->credits;
+            child->credits += missing < free ? missing : free;
+        }
+        // After a slot frees up hand it to a child that is waiting for credit.
+        // Start where the previous grant stopped so every child gets its turn.
+        // Children we stopped waiting for come last, but may still come back.
+        auto grant_freed_credits() const -> void
+        {
+            grant_freed_credits(false);
+            grant_freed_credits(true);
+        }
+        auto grant_freed_credits(bool is_abandoned_turn) const -> void
+        {
+            for (uint32_t i = 0; i < state->child_count && free_credits() > 0; i++)
+            {
+                state->grant_cursor = (state->grant_cursor + 1) % state->child_count;
+                auto &child = state->children[state->grant_cursor];
+                if (child.is_done || child.credits > 0 || is_abandoned(child) != is_abandoned_turn)
+                    continue;
+                top_up_credits(&child);
+                child.grant_pending = true;
+                send_credit(child.child_id, child.credits);
+            }
+        }
+        // Credit packets are not acknowledged, so repeat them while the line is quiet
+        auto resend_pending_grants() const -> void
+        {
+            for (uint32_t i = 0; i < state->child_count; i++)
+            {
+                const auto &child = state->children[i];
+                if (child.grant_pending && !child.is_done)
+                    send_credit(child.child_id, child.credits);
+            }
+        }
+        auto find_child(Id child_id) const -> Child *
+        {
+            for (uint32_t i = 0; i < state->child_count; i++)
+                if (state->children[i].child_id == child_id)
+                    return &state->children[i];
+            return nullptr;
+        }
+        auto add_child(Id child_id) const -> Child *
+        {
+            const auto existing = find_child(child_id);
+            if (existing != nullptr)
+                return existing;
+            if (state->child_count == max_children)
+                return nullptr;
+            auto &child = state->children[state->child_count++];
+            child = {child_id, 0, false, false, 1, no_slot, no_slot, 0, 0, false, 0, false, 0, false, false, false, 0};
+            return &child;
+        }
+        auto deliver(ConstPacketWrapper packet_wrapper) const -> Result
+        {
+            state->is_backed_up = false;
+            if (is_best_effort(packet_wrapper))
+                return transmit_best_effort(packet_wrapper);
+            // A radio retrying on its own already spent its attempts when it reports failure
+            const auto max_attempts = Transport::hardware_retry ? 1u : attempts_for(packet_wrapper);
+            const auto receiver_id = packet_wrapper.packet->receiver_id;
+            const auto has_candidates = (data_flags_of(packet_wrapper) & DataFlags::HasCandidates) != 0;
+            // Control frames stay at the robust rate and their losses say nothing about the faster ones
+            const auto is_data = packet_wrapper.packet->msg_type == MsgType::Data;
+            if (is_data)
+                start_delivery(receiver_id);
+            for (auto attempts = 0u; attempts < max_attempts; attempts++)
+            {
+                // Joins cannot wait, the parent only probes once it serves its children
+                if (Config::receiver_initiated && packet_wrapper.packet->msg_type != MsgType::IAmChild)
+                    wait_for_probe(receiver_id);
+                honour_reservation();
+                sleep(sleep_time);
+                while (is_channel_busy())
+                    sleep(sleep_time);
+                // A long frame lost to a hidden sibling costs more than the handshake
+                if (is_data && !reserve_channel(receiver_id, packet_wrapper.length))
+                    continue;
+                const auto rate = is_data ? select_rate(attempts) : uint8_t{0};
+                Result result;
+                if constexpr (Transport::hardware_ack)
+                    result = transmit_with_hardware_ack(packet_wrapper);
+                else
+                {
+                    transmit_packet(packet_wrapper);
+                    // Rank 1 sends to the collector, which forwards nothing
+                    if (is_acked_by_forward(packet_wrapper, state->rank <= 1))
+                        result = get_implicit_ack(packet_wrapper);
+                    else
+                        result = get_ack(receiver_id, has_candidates);
+                }
+                use_rate(0); // The next attempt may start with an RTS or acks for our children
+                if (is_data)
+                    record_rate(rate, result ? 1 : 0, 1);
+                if (result)
+                    return Result::Ok;
+            }
+            return Result::Fail;
+        };
+        // Fire and forget, so count the credit ourselves as with hardware acks
+        auto transmit_best_effort(ConstPacketWrapper packet_wrapper) const -> Result
+        {
+            if constexpr (Config::receiver_initiated)
+                wait_for_probe(packet_wrapper.packet->receiver_id);
+            honour_reservation();
+            sleep(sleep_time);
+            while (is_channel_busy())
+                sleep(sleep_time);
+            reserve_channel(packet_wrapper.packet->receiver_id, packet_wrapper.length);
+            start_delivery(packet_wrapper.packet->receiver_id);
+            select_rate(0); // No ack tells us how it went, so nothing to record
+            transmit_packet(packet_wrapper);
+            use_rate(0);
+            if (state->parent_credits > 0 && state->parent_credits != unlimited_credits)
+                state->parent_credits--;
+            return Result::Ok;
+        }
+        // RTS/CTS for long frames. Returns Fail when the parent did not clear
+        // us to send, so the long frame is not wasted on a busy parent.
+        auto reserve_channel(Id receiver_id, uint32_t length) const -> Result
+        {
+            if (Config::rts_threshold == 0 || length < Config::rts_threshold)
+                return Result::Ok;
+            const ReservationPacket packet = {
+                MsgType::Rts,
+                id,
+                receiver_id,
+                state->epoch,
+                reservation_ms(length),
+            };
+            transmit(packet);
+            auto overheard = 0;
+            for (auto attempts = 0; attempts < 3 && overheard < 32;)
+            {
+                const auto [reply, reply_length] = receive_packet(10);
+                if (reply_length == 0)
+                {
+                    attempts++;
+                    continue;
+                }
+                overheard++;
+                // Our radio already acknowledged it, so the child will not send it again
+                const auto is_from_child = reply->receiver_id == id && find_child(reply->transmitter_id) != nullptr;
+                if (Transport::hardware_ack && is_from_child)
+                {
+                    receive_from_child({reply, reply_length});
+                    continue;
+                }
+                const auto is_cts = reply->msg_type == MsgType::Cts && reply->receiver_id == id;
+                if (is_cts && reply->transmitter_id == receiver_id)
+                {
+                    state->reserved_ms = 0; // The parent granted the channel to us, not to whoever we heard before
+                    return Result::Ok;
+                }
+            }
+            return Result::Fail;
+        }
+        // Time the long frame and its ack take at the most robust rate, which
+        // bounds whatever rate the frame ends up at
+        static constexpr auto reservation_ms(uint32_t length) -> uint16_t
+        {
+            uint32_t kbps = Transport::bitrate_kbps;
+            if constexpr (Transport::data_rates_kbps != nullptr)
+                kbps = Transport::data_rates_kbps[0];
+            const auto airtime_ms = ((length + credit_packet_size) * 8 + kbps - 1) / kbps;
+            return static_cast<uint16_t>(airtime_ms + Config::rts_guard_ms);
+        }
+        // Sit out what is left of an overheard reservation. Without a clock we
+        // cannot tell how much that is, so sit out all of it.
+        auto honour_reservation() const -> void
+        {
+            if (state->reserved_ms == 0)
+                return;
+            if constexpr (Config::clock != nullptr)
+                sleep_until(state->reserved_at + state->reserved_ms);
+            else
+                sleep(state->reserved_ms * 1000);
+            state->reserved_ms = 0;
+        }
+        // Rate adaptation, Minstrel style. The first attempt of a delivery uses
+        // the rate with the best expected throughput, except every
+        // rate_sample_interval deliveries, which try another rate to keep its
+        // statistics fresh. Retries fall back to the second best rate, then to
+        // the most reliable one.
+        auto start_delivery(Id receiver_id) const -> void
+        {
+            if constexpr (is_rate_adaptive)
+            {
+                auto &control = state->rate_control;
+                if (control.neighbour_id != receiver_id)
+                {
+                    control = {};
+                    control.neighbour_id = receiver_id;
+                    control.rates[0].probability = 1024; // Nothing known yet, start with the robust rate
+                    control.current = unknown_rate;
+                }
+                control.deliveries++;
+            }
+        }
+        auto select_rate(uint32_t attempt) const -> uint8_t
+        {
+            if constexpr (!is_rate_adaptive)
+                return 0;
+            else
+            {
+                auto &control = state->rate_control;
+                uint8_t best = 0, reliable = 0;
+                for (uint8_t rate = 1; rate < data_rate_count; rate++)
+                {
+                    if (throughput_of(rate) > throughput_of(best))
+                        best = rate;
+                    if (control.rates[rate].probability > control.rates[reliable].probability)
+                        reliable = rate;
+                }
+                uint8_t second = best == 0 ? 1 : 0;
+                for (uint8_t rate = 0; rate < data_rate_count; rate++)
+                    if (rate != best && throughput_of(rate) > throughput_of(second))
+                        second = rate;
+                auto rate = reliable;
+                if (attempt == 0 && control.deliveries % Config::rate_sample_interval == 0)
+                {
+                    rate = control.next_sample;
+                    control.next_sample = (control.next_sample + 1) % data_rate_count;
+                    if (rate == best)
+                        rate = second;
+                }
+                else if (attempt == 0)
+                    rate = best;
+                else if (attempt == 1)
+                    rate = second;
+                use_rate(rate);
+                return rate;
+            }
+        }
+        auto throughput_of(uint8_t rate) const -> uint32_t
+        {
+            return static_cast<uint32_t>(state->rate_control.rates[rate].probability) * Transport::data_rates_kbps[rate];
+        }
+        auto record_rate(uint8_t rate, uint32_t successes, uint32_t attempts) const -> void
+        {
+            if constexpr (is_rate_adaptive)
+            {
+                auto &control = state->rate_control;
+                control.rates[rate].attempts += attempts;
+                control.rates[rate].successes += successes;
+                control.window += attempts;
+                if (control.window < Config::rate_window)
+                    return;
+                control.window = 0;
+                // Exponentially weighted, the new window counts for a quarter
+                for (auto &stats : control.rates)
+                {
+                    if (stats.attempts == 0)
+                        continue;
+                    const auto recent = stats.successes * 1024u / stats.attempts;
+                    stats.probability = static_cast<uint16_t>((stats.probability * 3u + recent) / 4);
+                    stats.attempts = 0;
+                    stats.successes = 0;
+                }
+            }
+        }
+        // Everything but data towards the parent goes at the robust rate
+        auto use_rate(uint8_t rate) const -> void
+        {
+            if constexpr (is_rate_adaptive)
+            {
+                if (state->rate_control.current == rate)
+                    return;
+                state->rate_control.current = rate;
+                Transport::set_data_rate(rate);
+            }
+        }
+        auto bits_set(uint8_t bits) const -> uint32_t
+        {
+            auto count = 0u;
+            for (; bits != 0; bits &= bits - 1)
+                count++;
+            return count;
+        }
+        auto attempts_for(ConstPacketWrapper packet_wrapper) const -> uint32_t
+        {
+            const auto flags = data_flags_of(packet_wrapper);
+            if ((flags & DataFlags::LimitedRetry) && !(flags & DataFlags::SubtreeComplete))
+                return Config::limited_retry_attempts;
+            return 10;
+        }
+        // The parent relies on subtree completion to end its round, so that always goes reliably
+        auto is_best_effort(ConstPacketWrapper packet_wrapper) const -> bool
+        {
+            const auto flags = data_flags_of(packet_wrapper);
+            return (flags & DataFlags::BestEffort) && !(flags & DataFlags::SubtreeComplete);
+        }
+        // Reliable data towards a relay is confirmed by overhearing the relay
+        // forward it. Bursts have block acks and EndOfData is never forwarded.
+        auto is_acked_by_forward(ConstPacketWrapper packet_wrapper, bool is_receiver_collector) const -> bool
+        {
+            if (Config::implicit_ack_ms == 0 || is_receiver_collector || packet_wrapper.packet->msg_type != MsgType::Data)
+                return false;
+            const auto flags = data_flags_of(packet_wrapper);
+            const auto excluded = DataFlags::BestEffort | DataFlags::Burst | DataFlags::HasCandidates; // Candidates listen for an ack
+            return !(flags & excluded) && packet_wrapper.length >= data_header_size;
+        }
+        auto is_burst_frame(ConstPacketWrapper packet_wrapper) const -> bool
+        {
+            return (data_flags_of(packet_wrapper) & DataFlags::Burst) != 0;
+        }
+        // Everything after the DataInfo except the candidate list
+        auto payload_length_of(ConstPacketWrapper packet_wrapper) const -> uint32_t
+        {
+            const auto length = packet_wrapper.length - data_header_size;
+            if (!(data_flags_of(packet_wrapper) & DataFlags::HasCandidates))
+                return length;
+            const auto list_size = reinterpret_cast<const uint8_t *>(packet_wrapper.packet)[packet_wrapper.length - 1] * sizeof(Id) + 1;
+            return list_size <= length ? length - list_size : 0;
+        }
+        auto data_flags_of(ConstPacketWrapper packet_wrapper) const -> uint16_t
+        {
+            if (packet_wrapper.packet->msg_type != MsgType::Data || packet_wrapper.length < data_header_size)
+                return 0;
+            return reinterpret_cast<const DataInfo *>(packet_wrapper.packet->data)->flags;
+        }
+        auto reliability_flags() const -> uint16_t
+        {
+            switch (state->reliability)
+            {
+            case Reliability::BestEffort:
+                return DataFlags::BestEffort;
+            case Reliability::LimitedRetry:
+                return DataFlags::LimitedRetry;
+            default:
+                return 0;
+            }
+        }
+        // Hardware acks carry no credit, so keep count ourselves. The parent
+        // sends a Credit packet whenever it hands out more than we expect.
+        auto transmit_with_hardware_ack(ConstPacketWrapper packet_wrapper) const -> Result
+        {
+            const auto packet = packet_wrapper.packet;
+            const ConstBytes bytes = {
+                reinterpret_cast<const uint8_t *>(packet),
+                packet_wrapper.length,
+            };
+            if (Transport::transmit_acked(bytes, packet->receiver_id) != TxStatus::Acked)
+                return Result::Fail;
+            if (packet->msg_type == MsgType::IAmChild)
+                state->parent_credits = 0;
+            const auto is_counted = state->parent_credits > 0 && state->parent_credits != unlimited_credits;
+            if (packet->msg_type == MsgType::Data && is_counted)
+                state->parent_credits--;
+            return Result::Ok;
+        }
+        // With is_backup_welcome an ack from one of our candidates counts as well.
+        // It carries no credit, that is the parent's to give.
+        auto get_ack(Id transmitter_id, bool is_backup_welcome = false) const -> Result
+        {
+            // Overheard traffic does not count as a failed attempt, otherwise
+            // a busy neighbourhood makes us retransmit frames that got through
+            auto overheard = 0;
+            for (auto attempts = 0; attempts < 3 && overheard < 32;)
+            {
+                const auto [packet, length] = receive_packet(10);
+                if (length == 0)
+                {
+                    attempts++;
+                    continue;
+                }
+                overheard++;
+                const auto is_receiver_ok = packet->receiver_id == id;
+                const auto is_transmitter_ok = packet->transmitter_id == transmitter_id;
+                const auto is_msg_type_ok = packet->msg_type == MsgType::Ack;
+                const auto is_everything_ok = is_receiver_ok && is_transmitter_ok && is_msg_type_ok;
+                if (is_everything_ok)
+                {
+                    state->parent_credits = credits_of({packet, length});
+                    if (state->epoch == unknown_epoch)
+                        state->epoch = packet->epoch; // Rejoined from the checkpoint, the ack tells us the round
+                    return Result::Ok;
+                }
+                if (is_backup_welcome && is_receiver_ok && is_msg_type_ok && is_candidate(packet->transmitter_id))
+                {
+                    state->is_backed_up = true;
+                    return Result::Ok;
+                }
+            }
+            return Result::Fail;
+        };
+        // The parent forwarding our frame confirms it as well as an ack would. It
+        // acks explicitly when we repeat a frame, so an ack is still welcome.
+        auto get_implicit_ack(ConstPacketWrapper packet_wrapper) const -> Result
+        {
+            const auto parent_id = packet_wrapper.packet->receiver_id;
+            const auto checksum = data_checksum(packet_wrapper);
+            auto is_credit_known = false; // The parent already counted our frame in a Credit packet
+            auto overheard = 0;
+            for (auto waited_ms = 0u; waited_ms < Config::implicit_ack_ms && overheard < 32;)
+            {
+                const auto [packet, length] = receive_packet(10);
+                if (length == 0)
+                {
+                    waited_ms += 10;
+                    continue;
+                }
+                overheard++;
+                if (packet->transmitter_id != parent_id)
+                    continue;
+                const auto is_to_us = packet->receiver_id == id;
+                if (is_to_us && (packet->msg_type == MsgType::Ack || packet->msg_type == MsgType::Credit))
+                {
+                    state->parent_credits = credits_of({packet, length});
+                    is_credit_known = true;
+                    if (packet->msg_type == MsgType::Ack)
+                        return Result::Ok;
+                    continue;
+                }
+                const auto is_forward = !is_to_us && packet->msg_type == MsgType::Data && length >= data_header_size;
+                if (is_forward && data_checksum({packet, length}) == checksum)
+                {
+                    const auto is_counted = state->parent_credits > 0 && state->parent_credits != unlimited_credits;
+                    if (is_counted && !is_credit_known)
+                        state->parent_credits--;
+                    return Result::Ok;
+                }
+            }
+            return Result::Fail;
+        }
+        // Positions of our burst the parent confirmed, 0 when no block ack came
+        auto get_block_ack(Id transmitter_id) const -> uint8_t
+        {
+            auto overheard = 0;
+            for (auto attempts = 0; attempts < 3 && overheard < 32;)
+            {
+                const auto [packet, length] = receive_packet(10);
+                if (length == 0)
+                {
+                    attempts++;
+                    continue;
+                }
+                overheard++;
+                const auto is_block_ack = packet->msg_type == MsgType::BlockAck && length >= block_ack_packet_size;
+                if (is_block_ack && packet->receiver_id == id && packet->transmitter_id == transmitter_id)
+                {
+                    state->parent_credits = credits_of({packet, length});
+                    return reinterpret_cast<const BlockAckPacket *>(packet)->received;
+                }
+            }
+            return 0;
+        }
+        auto start_deadline(uint32_t length_ms) const -> Deadline
+        {
+            if constexpr (Config::clock != nullptr)
+                return {Config::clock(), length_ms, 0};
+            return {0, length_ms, 0};
+        }
+        // With a clock the time is measured. Without one every receive counts
+        // as its full timeout, so a busy channel can end the wait early but
+        // never make it last longer.
+        auto time_left(const Deadline &deadline) const -> uint32_t
+        {
+            auto spent_ms = deadline.spent_ms;
+            if constexpr (Config::clock != nullptr)
+                spent_ms = Config::clock() - deadline.started_at;
+            return spent_ms < deadline.length_ms ? deadline.length_ms - spent_ms : 0;
+        }
+        // Must only be called with time left. Without a clock poll_ms bounds
+        // what a single overheard frame costs the wait.
+        auto receive_before(Deadline &deadline, uint32_t poll_ms) const -> PacketWrapper
+        {
+            const auto left = time_left(deadline);
+            const auto timeout = Config::clock != nullptr || left < poll_ms ? left : poll_ms;
+            deadline.spent_ms += timeout;
+            return receive_packet(timeout);
+        }
+        // Block until the parent lets us send another data packet. If it stays
+        // silent for too long assume its credit packet got lost and send anyway.
+        // Traffic for others does not restart the wait.
+        auto wait_for_credit(Id parent_id, uint32_t max_wait_ms = Config::credit_timeout_ms) const -> void
+        {
+            auto deadline = start_deadline(max_wait_ms);
+            while (state->parent_credits == 0 && time_left(deadline) > 0)
+            {
+                const auto [packet, length] = receive_before(deadline, 50);
+                if (length == 0)
+                    continue;
+                const auto is_credit = packet->msg_type == MsgType::Credit && packet->receiver_id == id;
+                if (is_credit && packet->transmitter_id == parent_id)
+                    state->parent_credits = credits_of({packet, length});
+            }
+        }
+        // Any probe, ack or credit from the parent shows it is listening now. The
+        // usual backoff in deliver() then spreads out siblings that heard it too.
+        // A parent that never probes gets our data anyway after credit_timeout_ms,
+        // however busy its neighbourhood keeps the channel.
+        auto wait_for_probe(Id parent_id) const -> void
+        {
+            auto deadline = start_deadline(Config::credit_timeout_ms);
+            while (time_left(deadline) > 0)
+            {
+                const auto [packet, length] = receive_before(deadline, 50);
+                if (length == 0)
+                    continue;
+                if (packet->receiver_id == id && find_child(packet->transmitter_id) != nullptr)
+                {
+                    // Waiting may take a while, our own children would run out of retries meanwhile
+                    receive_from_child({packet, length});
+                    continue;
+                }
+                if (packet->transmitter_id != parent_id)
+                    continue;
+                if (packet->msg_type == MsgType::Credit && packet->receiver_id == id)
+                    state->parent_credits = credits_of({packet, length});
+                const auto is_listening = packet->msg_type == MsgType::Probe || packet->msg_type == MsgType::Ack ||
+                                          packet->msg_type == MsgType::Credit;
+                if (is_listening)
+                    return;
+            }
+        }
+        // Beacon suppression: listen for a while first, and stay quiet if enough
+        // nodes at least as close to the collector already announced themselves.
+        // The listening time depends on the id so neighbours do not decide in lockstep.
+        auto should_beacon() const -> bool
+        {
+            if constexpr (is_collector || Config::beacon_redundancy == 0)
+                return true;
+            for (auto waited_ms = 0u; waited_ms < 1 + id % Config::beacon_listen_ms; waited_ms++)
+            {
+                if (state->overheard_beacons >= Config::beacon_redundancy)
+                    return false;
+                const auto [packet, length] = receive_packet(1);
+                if (length > 0 && packet->receiver_id == id && packet->msg_type == MsgType::Credit)
+                    state->parent_credits = credits_of({packet, length});
+            }
+            return state->overheard_beacons < Config::beacon_redundancy;
+        }
+        auto solicit_parent() const -> void
+        {
+            const Header packet = {
+                MsgType::SolicitParent,
+                id,
+                broadcast,
+                state->epoch,
+            };
+            sleep(sleep_time);
+            while (is_channel_busy())
+                sleep(sleep_time);
+            transmit(packet);
+        }
+        // A neighbour that hears nobody but us keeps asking for a parent, so
+        // even with our beacon skipped we listen for it. Two solicit intervals
+        // and a short poll make sure one lands in the window even without a
+        // clock, where every frame heard counts as a whole poll. Returns true
+        // if we answered and may get a child.
+        auto await_solicitation() const -> bool
+        {
+            if constexpr (Config::solicit_interval_ms == 0)
+                return false;
+            auto deadline = start_deadline(2 * Config::solicit_interval_ms);
+            while (time_left(deadline) > 0)
+            {
+                const auto [packet, length] = receive_before(deadline, 10);
+                if (length == 0)
+                    continue;
+                if (packet->receiver_id == id && packet->msg_type == MsgType::Credit)
+                    state->parent_credits = credits_of({packet, length});
+                if (packet->msg_type == MsgType::SolicitParent && answer_solicitation(packet->transmitter_id))
+                    return true;
+            }
+            return false;
+        }
+        // Only nodes that could take the child answer, the id based backoff in
+        // transmit_i_am_parent keeps several answering neighbours apart
+        auto answer_solicitation(Id solicitor_id) const -> bool
+        {
+            const auto has_room = state->child_count < max_children && free_credits() > 0;
+            if (!(is_collector || state->is_joined) || !has_room)
+                return false;
+            transmit_i_am_parent(solicitor_id);
+            return true;
+        }
+        auto transmit_i_am_parent(Id receiver_id = broadcast) const -> void
+        {
+            BeaconPacket packet = {
+                MsgType::IAmParent,
+                id,
+                receiver_id,
+                state->epoch,
+                is_collector ? unlimited_credits : static_cast<uint8_t>(free_credits()),
+                is_collector ? static_cast<uint8_t>(0) : state->rank,
+                0,
+            };
+            sleep(sleep_time);
+            while (is_channel_busy())
+                sleep(sleep_time);
+            packet.data_phase_ms = data_phase_ms(); // Otherwise every hop would start the data phase a backoff later
+            transmit(packet);
+        }
+        auto transmit_probe() const -> void
+        {
+            const CreditPacket packet = {
+                MsgType::Probe,
+                id,
+                broadcast,
+                state->epoch,
+                static_cast<uint8_t>(free_credits()),
+            };
+            while (is_channel_busy())
+                sleep(sleep_time);
+            transmit(packet);
+        }
+        auto send_own_data(uint32_t parent_id, uint16_t flags) const -> Result
+        {
+            wait_for_credit(parent_id);
+            // Sample only now, the reading would go stale during tree formation
+            auto payload_length = data_length;
+            if constexpr (Config::stream_count > 0)
+                payload_length = pack_due_streams();
+            else if constexpr (Config::produce != nullptr)
+                Config::produce({data_packet->data + sizeof(DataInfo), data_length});
+            data_packet->receiver_id = parent_id;
+            data_packet->epoch = state->epoch;
+            // Expendable data may get lost, so completion follows it as a bare EndOfData
+            const auto is_expendable = state->reliability != Reliability::Reliable;
+            const auto is_completing = (flags & DataFlags::SubtreeComplete) != 0;
+            auto info = reinterpret_cast<DataInfo *>(data_packet->data);
+            info->subtree_size = subtree_size();
+            info->flags = (is_expendable ? flags & ~DataFlags::SubtreeComplete : flags) | reliability_flags();
+            const auto result = deliver({data_packet,
+                                         attach_candidates(data_packet, data_header_size + payload_length)});
+            if (is_completing && is_expendable)
+                return send_end_of_data(parent_id);
+            if (result && is_completing && state->is_backed_up)
+                send_end_of_data(parent_id); // A candidate took our last frame, the parent still waits for it
+            return is_expendable ? Result::Ok : result; // Lost expendable data is not sent again
+        }
+        // Only streams whose period is up cost airtime this round. Returns the payload length.
+        auto pack_due_streams() const -> uint32_t
+        {
+            const auto payload = data_packet->data + sizeof(DataInfo);
+            uint32_t length = 0;
+            for (uint32_t i = 0; i < Config::stream_count; i++)
+            {
+                const auto &stream = Config::streams[i];
+                if (state->round % stream.period != 0)
+                    continue;
+                auto record = reinterpret_cast<RecordHeader *>(payload + length);
+                record->stream_id = stream.stream_id;
+                record->length = stream.length;
+                stream.produce({payload + length + sizeof(RecordHeader), stream.length});
+                length += sizeof(RecordHeader) + stream.length;
+            }
+            return length;
+        }
+        auto unpack_streams(Id source_id, ConstBytes payload) const -> void
+        {
+            uint32_t offset = 0;
+            while (offset + sizeof(RecordHeader) <= payload.len)
+            {
+                const auto record = reinterpret_cast<const RecordHeader *>(payload.buf + offset);
+                offset += sizeof(RecordHeader);
+                if (offset + record->length > payload.len)
+                    return; // Truncated record
+                Config::stream_callback(source_id, record->stream_id, {payload.buf + offset, record->length});
+                offset += record->length;
+            }
+        }
+        auto send_end_of_data(uint32_t parent_id) const -> Result
+        {
+            static Packet packet = {
                 MsgType::EndOfData,
                 id,
-                0};
+                broadcast,
+                unknown_epoch};
             packet.receiver_id = parent_id;
-            deliver({&packet,
-                     header_size});
+            packet.epoch = state->epoch;
+            return deliver({&packet,
+                            header_size});
+        }
+        // Confirm a packet from a child and tell it its credit. Software acks
+        // carry the credit. A hardware ack already told the child the packet got
+        // through, so a Credit packet is only needed when the credit differs
+        // from what the child will assume.
+        auto acknowledge(Id child_id, uint8_t credits, uint8_t believed_credits) const -> void
+        {
+            if constexpr (Transport::hardware_ack)
+            {
+                notify_credit(child_id, credits, believed_credits);
+                return;
+            }
+            send_ack(child_id, credits);
         }
-        auto send_ack(Id receiver_id) const -> void
+        // The child already counted the packet against its credit
+        auto notify_credit(Id child_id, uint8_t credits, uint8_t believed_credits) const -> void
         {
-            Header packet = {
+            if (credits != believed_credits)
+                send_credit(child_id, credits);
+        }
+        auto send_ack(Id receiver_id, uint8_t credits) const -> void
+        {
+            const CreditPacket packet = {
                 MsgType::Ack,
                 id,
-                0,
+                receiver_id,
+                state->epoch,
+                credits,
+            };
+            while (is_channel_busy())
+                sleep(sleep_time);
+            transmit(packet);
+        }
+        auto send_block_ack(Id receiver_id, uint8_t credits, uint8_t received) const -> void
+        {
+            const BlockAckPacket packet = {
+                MsgType::BlockAck,
+                id,
+                receiver_id,
+                state->epoch,
+                credits,
+                received,
             };
-            packet.receiver_id = receiver_id;
             while (is_channel_busy())
                 sleep(sleep_time);
             transmit(packet);
         }
+        auto send_cts(Id receiver_id, uint16_t reserve_ms) const -> void
+        {
+            const ReservationPacket packet = {
+                MsgType::Cts,
+                id,
+                receiver_id,
+                state->epoch,
+                reserve_ms,
+            };
+            transmit(packet); // Right away, the child is waiting and everyone else defers to it
+        }
+        auto send_credit(Id receiver_id, uint8_t credits) const -> void
+        {
+            const CreditPacket packet = {
+                MsgType::Credit,
+                id,
+                receiver_id,
+                state->epoch,
+                credits,
+            };
+            while (is_channel_busy())
+                sleep(sleep_time);
+            transmit(packet);
+        }
+        // Packets from older firmware carry no credit field, treat them as one slot
+        auto credits_of(ConstPacketWrapper packet_wrapper) const -> uint8_t
+        {
+            if (packet_wrapper.length < credit_packet_size)
+                return 1;
+            return reinterpret_cast<const CreditPacket *>(packet_wrapper.packet)->credits;
+        }
+        // Packets from older firmware carry no rank, treat them as coming from the collector
+        auto rank_of(ConstPacketWrapper packet_wrapper) const -> uint8_t
+        {
+            if (packet_wrapper.length < beacon_packet_size)
+                return 0;
+            return reinterpret_cast<const BeaconPacket *>(packet_wrapper.packet)->rank;
+        }
+        // Keep the closest beaconing neighbours, the first heard among equals
+        auto note_candidate(Id candidate_id, uint8_t rank) const -> void
+        {
+            auto &count = state->candidate_count;
+            for (uint32_t i = 0; i < count; i++)
+                if (state->candidates[i].candidate_id == candidate_id)
+                    return;
+            auto position = count;
+            while (position > 0 && state->candidates[position - 1].rank > rank)
+                position--;
+            if (position == Config::forwarding_candidates)
+                return;
+            if (count < Config::forwarding_candidates)
+                count++;
+            for (auto i = count - 1; i > position; i--)
+                state->candidates[i] = state->candidates[i - 1];
+            state->candidates[position] = {candidate_id, rank};
+        }
+        // Candidates we list are closer to the collector than us and not our parent
+        auto is_candidate(Id candidate_id) const -> bool
+        {
+            for (uint32_t i = 0; i < state->candidate_count; i++)
+            {
+                const auto &candidate = state->candidates[i];
+                if (candidate.candidate_id == candidate_id)
+                    return candidate.rank < state->rank && candidate_id != state->parent_id;
+            }
+            return false;
+        }
+        // Append our candidates to reliable data when there is room. Returns the new length.
+        auto attach_candidates(Packet *packet, uint32_t length) const -> uint32_t
+        {
+            if constexpr (!is_opportunistic)
+                return length;
+            const auto flags = data_flags_of({packet, length});
+            const auto is_reliable = !(flags & (DataFlags::BestEffort | DataFlags::Burst));
+            if (packet->msg_type != MsgType::Data || !is_reliable || length + candidates_size > max_packet_size)
+                return length;
+            auto bytes = reinterpret_cast<uint8_t *>(packet);
+            uint8_t count = 0;
+            for (uint32_t i = 0; i < state->candidate_count; i++)
+            {
+                const auto candidate_id = state->candidates[i].candidate_id;
+                if (!is_candidate(candidate_id))
+                    continue;
+                for (uint32_t j = 0; j < sizeof(Id); j++)
+                    bytes[length++] = reinterpret_cast<const uint8_t *>(&candidate_id)[j];
+                count++;
+            }
+            if (count == 0)
+                return length;
+            bytes[length++] = count;
+            reinterpret_cast<DataInfo *>(packet->data)->flags |= DataFlags::HasCandidates;
+            return length;
+        }
+        auto data_phase_ms_of(ConstPacketWrapper packet_wrapper) const -> uint16_t
+        {
+            if (packet_wrapper.length < beacon_packet_size)
+                return 0;
+            return reinterpret_cast<const BeaconPacket *>(packet_wrapper.packet)->data_phase_ms;
+        }
+        auto data_phase_ms() const -> uint16_t
+        {
+            if constexpr (!Config::staggered)
+                return 0;
+            else
+                return is_before(state->data_phase_at) ? static_cast<uint16_t>(time_until(state->data_phase_at)) : 0;
+        }
+        // Frames of another round are dropped right here, so late retransmissions
+        // and old beacons cannot misroute us or hold up our timeouts. The
+        // timeout is kept however many of them arrive, 0 waits for a fresh frame.
         auto receive_packet(uint32_t timeout) const -> PacketWrapper
         {
-            const auto [buffer, length] = receive(timeout);
-            return {reinterpret_cast<Packet *>(buffer), length};
+            auto deadline = start_deadline(timeout);
+            auto bytes = receive(timeout);
+            while (bytes.len >= header_size && is_stale(reinterpret_cast<const Packet *>(bytes.buf)))
+            {
+                deadline.spent_ms = timeout; // Without a clock assume the stale frame took all of it
+                const auto left = time_left(deadline);
+                if (timeout > 0 && left == 0)
+                {
+                    bytes.len = 0;
+                    break;
+                }
+                bytes = receive(left);
+            }
+            const auto length = bytes.len;
+            const PacketWrapper packet_wrapper = {reinterpret_cast<Packet *>(bytes.buf), length};
+            // Until we join, parent_id is last round's parent, which may be a round behind
+            const auto is_from_parent = length >= header_size && state->is_joined &&
+                                        packet_wrapper.packet->transmitter_id == state->parent_id &&
+                                        packet_wrapper.packet->receiver_id == id;
+            if (is_from_parent && state->epoch == unknown_epoch)
+                state->epoch = packet_wrapper.packet->epoch; // Rejoined from the checkpoint without an ack to tell us
+            const auto is_reservation = length >= reservation_packet_size && packet_wrapper.packet->msg_type == MsgType::Cts;
+            if (is_reservation && packet_wrapper.packet->receiver_id != id)
+            {
+                state->reserved_ms = reinterpret_cast<const ReservationPacket *>(packet_wrapper.packet)->reserve_ms;
+                if constexpr (Config::clock != nullptr)
+                    state->reserved_at = Config::clock();
+            }
+            const auto is_beacon = length >= header_size && packet_wrapper.packet->msg_type == MsgType::IAmParent;
+            if (is_beacon && state->is_joined && rank_of(packet_wrapper) <= state->rank)
+                state->overheard_beacons++;
+            if (is_opportunistic && is_beacon && length >= beacon_packet_size)
+                note_candidate(packet_wrapper.packet->transmitter_id, rank_of(packet_wrapper));
+            return packet_wrapper;
+        }
+        // Epoch 0 comes from nodes that have not learnt the round yet, like a
+        // child rejoining from its checkpoint, and is always accepted
+        auto is_stale(const Packet *packet) const -> bool
+        {
+            if (packet->epoch == unknown_epoch)
+                return false;
+            if (state->epoch == unknown_epoch)
+                return packet->epoch == state->last_epoch;
+            return packet->epoch != state->epoch;
         }
         auto transmit_packet(ConstPacketWrapper packet) const -> void
         {
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+# Worst-case stack usage of each Handle entry point, from the call graphs GCC
+# writes with -fcallgraph-info=su. Compile the translation units that use
+# minimesh with the flags of the real build plus that option, then pass the
+# resulting .ci files:
+#   g++ -std=c++17 -Os -c -fstack-usage -fcallgraph-info=su main.cpp
+#   python3 stack_report.py main.ci
+# Entry points the compiler inlined are covered by the functions they were
+# inlined into, those that call Handle's other methods directly, like a task's
+# main function. Each is reported with the Handle instance it runs. Functions
+# compiled without the option, like the radio functions passed to Handle,
+# count as zero and are listed so their own stack can be added.
+# Recursion or dynamic allocation makes the bound unknown and is reported
+# instead of a number, and the exit status is then 1.
+import re
+import sys
+
+entry_points = ("run", "get_data_buffer", "set_reliability")
+
+node_pattern = re.compile(r'node: \{ title: "([^"]*)" label: "((?:[^"\\]|\\.)*)"')
+edge_pattern = re.compile(r'edge: \{ sourcename: "([^"]*)" targetname: "([^"]*)"')
+bytes_pattern = re.compile(r"\\n(\d+) bytes \(([^)]*)\)")
+
+
+class Function:
+    def __init__(self, label):
+        self.name = label.split("\\n")[0]
+        usage = bytes_pattern.search(label)
+        self.is_external = usage is None
+        self.bytes = int(usage.group(1)) if usage else 0
+        self.is_bounded = usage is None or usage.group(2) in ("static", "dynamic,bounded")
+        self.callees = []
+
+
+def load(paths):
+    functions = {}
+    for path in paths:
+        with open(path) as file:
+            text = file.read()
+        for title, label in node_pattern.findall(text):
+            functions[title] = Function(label)
+        for source, target in edge_pattern.findall(text):
+            if target not in functions:
+                functions[target] = Function(target)
+            functions[source].callees.append(target)
+    return functions
+
+
+# Returns (bytes, path, reason), reason is None while the bound is known
+def worst_case(functions, title, memo, visiting):
+    if title in memo:
+        return memo[title]
+    function = functions[title]
+    if title in visiting:
+        return 0, [title], "recursion through " + short_name(function.name)
+    if not function.is_bounded:
+        return function.bytes, [title], "dynamic stack in " + short_name(function.name)
+    visiting.add(title)
+    deepest = (0, [], None)
+    for callee in set(function.callees):
+        candidate = worst_case(functions, callee, memo, visiting)
+        if candidate[2] is not None or deepest[2] is None and candidate[0] > deepest[0]:
+            deepest = candidate
+            if candidate[2] is not None:
+                break
+    visiting.discard(title)
+    result = (function.bytes + deepest[0], [title] + deepest[1], deepest[2])
+    if result[2] is None:
+        memo[title] = result
+    return result
+
+
+def reachable(functions, title, seen):
+    if title not in seen:
+        seen.add(title)
+        for callee in functions[title].callees:
+            reachable(functions, callee, seen)
+    return seen
+
+
+def short_name(name):
+    if name == "Indirect Call Placeholder":
+        return "function pointers"
+    name = re.sub(r"Handle<[^()]*?>::", "Handle::", name.split(" [with ")[0])
+    name = re.sub(r"^[^(]*? (?=[\w:~]+\()", "", name)  # Return type
+    return re.sub(r"\([^()]*\)( const)?$", "", name)
+
+
+def handle_method(function):
+    if "minimesh::Handle<" not in function.name:
+        return None
+    method = re.search(r"::(\w+)\([^()]*\) const \[with ", function.name)
+    return method.group(1) if method else None
+
+
+def instance_of(name):
+    found = re.search(r"unsigned int id = (\d+);.*bool is_collector = (\w+);.* Config = (.*)\]$", name)
+    if not found:
+        return ""
+    config = "" if found.group(3) == "minimesh::DefaultConfig" else ", " + found.group(3)
+    return "id %s%s%s" % (found.group(1), ", collector" if found.group(2) == "true" else "", config)
+
+
+def main(paths):
+    if not paths:
+        print("usage: stack_report.py file.ci...", file=sys.stderr)
+        return 2
+    functions = load(paths)
+    memo = {}
+    is_unbounded = False
+    reports = []
+    for title, function in functions.items():
+        if function.is_external:
+            continue
+        if handle_method(function) in entry_points:
+            instances = [instance_of(function.name)]
+        elif handle_method(function) is None:
+            # Out of line copies of Handle's other methods are dead once their callers were inlined
+            inlined = [functions[callee] for callee in function.callees if handle_method(functions[callee]) not in (None,) + entry_points]
+            instances = sorted({instance_of(callee.name) for callee in inlined})
+        else:
+            continue
+        if instances:
+            reports.append((short_name(function.name), "; ".join(instances), title))
+    for name, instance, title in sorted(reports):
+        size, path, reason = worst_case(functions, title, memo, set())
+        externals = sorted({short_name(functions[callee].name) for callee in reachable(functions, title, set()) if functions[callee].is_external})
+        print("%s (%s): %s" % (name, instance, "%d bytes" % size if reason is None else "unbounded, " + reason))
+        print("    " + " -> ".join(short_name(functions[step].name) for step in path))
+        if externals:
+            print("    plus the stack of " + ", ".join(externals))
+        is_unbounded = is_unbounded or reason is not None
+    return 1 if is_unbounded else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
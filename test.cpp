@@ -3,7 +3,150 @@
 
 // void delay_us(uint32_t us){};
 
+using namespace minimesh;
+
+// Radio stand-ins, only here so every configuration below gets compiled
+uint8_t frame[255];
+auto receive(uint32_t) -> Bytes { return {frame, 0}; }
+auto transmit(ConstBytes) -> void {}
+auto sleep_us(uint32_t) -> void {}
+auto is_channel_busy() -> bool { return false; }
+auto clock_ms() -> uint32_t { return 0; }
+auto transmit_acked(ConstBytes, Id) -> TxStatus { return TxStatus::Acked; }
+auto transmit_batch(const Bytes *, uint32_t) -> void {}
+auto set_data_rate(uint8_t) -> void {}
+auto save_state(ConstBytes) -> void {}
+auto load_state(Bytes) -> uint32_t { return 0; }
+auto produce(Bytes) -> void {}
+auto on_data(Id, ConstBytes) -> void {}
+auto on_sample(Id, uint8_t, ConstBytes) -> void {}
+
+constexpr uint16_t rates_kbps[] = {250, 1000, 2000};
+constexpr Stream streams[] = {{1, 2, 1, produce}, {2, 4, 10, produce}};
+
+struct HardwareAckTransport : BasicTransport
+{
+    static constexpr bool hardware_ack = true;
+    static constexpr bool hardware_retry = true;
+    static constexpr TransmitAckedFunc *transmit_acked = ::transmit_acked;
+};
+struct BatchTransport : BasicTransport
+{
+    static constexpr TransmitBatchFunc *transmit_batch = ::transmit_batch;
+};
+struct MultiRateTransport : BasicTransport
+{
+    static constexpr SetDataRateFunc *set_data_rate = ::set_data_rate;
+    static constexpr const uint16_t *data_rates_kbps = rates_kbps;
+    static constexpr uint8_t data_rate_count = 3;
+};
+struct SmallFrameTransport : BasicTransport
+{
+    static constexpr uint32_t mtu = 64;
+};
+
+struct PipelinedConfig : DefaultConfig
+{
+    static constexpr bool pipelined = true;
+};
+struct SuppressedBeaconConfig : DefaultConfig
+{
+    static constexpr uint32_t beacon_redundancy = 2;
+    static constexpr uint32_t solicit_interval_ms = 0;
+};
+struct HardwareAckConfig : DefaultConfig
+{
+    using Transport = HardwareAckTransport;
+};
+struct CheckpointConfig : DefaultConfig
+{
+    static constexpr SaveStateFunc *save_state = ::save_state;
+    static constexpr LoadStateFunc *load_state = ::load_state;
+};
+struct StaggeredConfig : DefaultConfig
+{
+    static constexpr bool staggered = true;
+    static constexpr ClockFunc *clock = clock_ms;
+};
+struct ReceiverInitiatedConfig : DefaultConfig
+{
+    static constexpr bool receiver_initiated = true;
+};
+struct ProduceConfig : DefaultConfig
+{
+    static constexpr ProduceFunc *produce = ::produce;
+};
+struct StreamConfig : DefaultConfig
+{
+    static constexpr const Stream *streams = ::streams;
+    static constexpr uint32_t stream_count = 2;
+    static constexpr StreamCallback *stream_callback = on_sample;
+};
+struct LimitedRetryConfig : DefaultConfig
+{
+    static constexpr ClockFunc *clock = clock_ms;
+};
+struct SmallFrameConfig : DefaultConfig
+{
+    using Transport = SmallFrameTransport;
+};
+struct BurstConfig : DefaultConfig
+{
+    using Transport = BatchTransport;
+};
+struct RateConfig : DefaultConfig
+{
+    using Transport = MultiRateTransport;
+};
+struct RtsConfig : DefaultConfig
+{
+    static constexpr uint32_t rts_threshold = 32;
+};
+struct ImplicitAckConfig : DefaultConfig
+{
+    static constexpr uint32_t implicit_ack_ms = 50;
+};
+struct OpportunisticConfig : DefaultConfig
+{
+    static constexpr uint32_t forwarding_candidates = 2;
+};
+
+template <typename Config, bool has_collector = true>
+auto instantiate() -> void
+{
+    const Handle<receive, transmit, sleep_us, is_channel_busy, 2, 16, false, no_callback, Config> sensor;
+    sensor.get_data_buffer()[0] = 1;
+    sensor.set_reliability(Reliability::LimitedRetry);
+    sensor.run();
+    if constexpr (has_collector)
+    {
+        const Handle<receive, transmit, sleep_us, is_channel_busy, 1, 0, true, on_data, Config> collector;
+        collector.run();
+    }
+}
+
+// Never called, compiling it is the test
+[[maybe_unused]] static auto instantiate_every_mode() -> void
+{
+    instantiate<DefaultConfig>();
+    instantiate<PipelinedConfig>();
+    instantiate<SuppressedBeaconConfig>();
+    instantiate<HardwareAckConfig>();
+    instantiate<CheckpointConfig, false>(); // The collector has no routing state to restore
+    instantiate<StaggeredConfig>();
+    instantiate<ReceiverInitiatedConfig>();
+    instantiate<ProduceConfig>();
+    instantiate<StreamConfig>();
+    instantiate<LimitedRetryConfig>();
+    instantiate<SmallFrameConfig>();
+    instantiate<BurstConfig>();
+    instantiate<RateConfig>();
+    instantiate<RtsConfig>();
+    instantiate<ImplicitAckConfig>();
+    instantiate<OpportunisticConfig>();
+}
+
 int main()
 {
     std::cout << "Hello" << std::endl;
-}
\ No newline at end of file
+}